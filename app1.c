@@ -36,7 +36,6 @@ main(int argc, char **argv)
 
     srand(time(0));
     printf ("RAND_MAX is %d\n", RAND_MAX);
-    semaphore_id = sem_open("/global_semaphore", 0);
     ret = fork();
     if (ret > 0) {
         // parent process - P1
@@ -51,7 +50,7 @@ main(int argc, char **argv)
         sem_post (sem1);
         
         while (1) {
-            n_sent = rand() % MAX_DATALEN;
+            n_sent = rand() % MAX_DATALEN + 1;  // MIN_DATALEN..MAX_DATALEN
             ret = mf_send (qid, (void *) sendbuffer, n_sent);
             printf ("app sent message, datalen=%d\n", n_sent);
             //printf("sentcount = %d \n", sentcount);
@@ -0,0 +1,86 @@
+// app3: the C++ interface. A parent and a child process pass
+// fixed-size records through a MF_MODE_FIXED queue with mf::Queue<T>,
+// then variable-length messages through a locked queue with
+// mf::ByteQueue.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "mf.hpp"
+
+struct order_t {
+    long id;
+    int qty;
+    double price;
+};
+
+static void child(int count)
+{
+    mf::Connection conn;
+    mf::Queue<order_t> orders("orders");
+    mf::ByteQueue notes("notes");
+
+    for (int i = 0; i < count; i++)
+        orders.send({i, i % 100, i * 0.25});
+
+    for (int i = 0; i < count; i++) {
+        char text[64];
+        int len = snprintf(text, sizeof(text), "note %d", i);
+        notes.send(std::as_bytes(std::span(text, len)));
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int errors = 0;
+
+    try {
+        mf::Connection conn;
+        mf::create_fixed<order_t>("orders", 64);
+        mf::create("notes", 16);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            try {
+                child(count);
+            } catch (const mf::Error &e) {
+                fprintf(stderr, "child: %s\n", e.what());
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        mf::Queue<order_t> orders("orders");
+        for (int i = 0; i < count; i++) {
+            order_t o = orders.recv();
+            if (o.id != i || o.qty != i % 100 || o.price != i * 0.25)
+                errors++;
+        }
+
+        mf::ByteQueue notes("notes");
+        for (int i = 0; i < count; i++) {
+            char expect[64];
+            snprintf(expect, sizeof(expect), "note %d", i);
+            mf::View v = notes.peek();
+            if (v.size() != strlen(expect) || memcmp(v.bytes().data(), expect, v.size()) != 0)
+                errors++;
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errors++;
+
+        mf::remove("orders");
+        mf::remove("notes");
+    } catch (const mf::Error &e) {
+        fprintf(stderr, "app3: %s\n", e.what());
+        return 1;
+    }
+
+    printf("app3: %d records and %d messages, %d errors\n", count, count, errors);
+    return errors != 0;
+}
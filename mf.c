@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,17 +8,36 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include "mf.h"
 #include <ctype.h> 
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22   // Linux 5.14
+#define MADV_POPULATE_WRITE 23
+#endif
+
 // Global variables to store configuration and shared memory information
 static char shmem_name[MAXFILENAME] = "";  // initialized to empty string
 static int shmem_size = 0;
 static int max_msgs_in_queue;
 static int max_queues_in_shmem;
 static void *shmem_addr = NULL;  // pointer initialization to NULL
-static sem_t *semaphore_id = NULL; 
 
 void *global_shmem_addr = NULL;  // initialize pointer to NULL
 int global_shmem_size = 0;       // initialize size to 0
@@ -25,6 +45,476 @@ int shm_fd = -1;                 // initialize file descriptor to invalid value
 
 
 shmem_metadata_t *shmem_metadata;
+static int mf_stat_slot;  // this process' slot in each queue's stats[]
+
+// broadcast queues this process subscribed to, by queue table slot
+static struct {
+    int qid;     // queue subscribed to, 0 for none
+    int cursor;  // index of our cursor in the queue's cursors
+} mf_subs[MF_MAX_QUEUES];
+
+// readiness eventfds this process holds (mfserver: made), by kind and
+// table slot
+#define MF_EV_DATA 0   // raised when the queue gets messages, mf_get_fd()
+#define MF_EV_SPACE 1  // raised when a receive frees room, mf_get_space_fd()
+static struct {
+    int qid;  // queue the fd belongs to, 0 for none
+    int fd;   // -1 if mfserver could not give one
+} mf_evfds[2][MF_MAX_QUEUES];
+static void mf_space_ready(mf_queue_t *queue);  // on receives and returned credits
+static int mf_listen_fd = -1;  // mfserver: socket mf_get_fd asks on
+
+// message credits this process took from a queue's pool and did not
+// spend yet, and its watermark callback, by table slot. The credits
+// are one word, (qid << 32) | count, changed only by CAS, as threads of
+// the process send on the same queues.
+static unsigned long mf_held[MF_MAX_QUEUES];
+static struct {
+    int qid;  // queue the callback is for, 0 for none
+    mf_watermark_fn fn;
+    void *arg;
+} mf_wm[MF_MAX_QUEUES];
+static void mf_msgs_return(mf_queue_t *queue);  // on mf_close
+static void mf_msgs_return_all();               // on mf_disconnect
+
+// how the region is backed and mapped, from the config file
+static int huge_pages = 0;     // HUGE_PAGES: try hugetlbfs, else ask for THP
+static char hugetlb_dir[MAXFILENAME] = "/dev/hugepages";  // HUGETLB_DIR
+static int prefault = 0;       // PREFAULT: MAP_POPULATE every mapping
+static int lock_pages = 0;     // MLOCK: keep the region in RAM
+static int max_segs = 8;       // MAX_SEGMENTS
+static int seg_grow = 0;       // SEGMENT_SIZE in bytes, 0 for SHMEM_SIZE
+
+// this process' mappings of the region's segments; a segment another
+// process added is mapped when a queue in it is first looked up
+typedef struct {
+    char *addr;  // NULL while not mapped here
+    int fd;      // kept open for mapping mirrored queue buffers
+    int size;    // bytes mapped: the segment rounded up to the page size
+    int huge;    // backed by a hugetlbfs file instead of POSIX shm
+    int busy;    // a thread of this process is mapping it, see mf_seg_map()
+} mf_seg_t;
+
+static mf_seg_t mf_segs[MF_MAX_SEGMENTS];
+static int mf_prot;  // protection of the mappings, from mf_init/mf_connect
+
+// the byte at region offset off
+static inline char *mf_at(int off) {
+    return mf_segs[off >> MF_SEG_SHIFT].addr + (off & MF_SEG_MASK);
+}
+
+void mf_qattr_init(mf_qattr_t *attr) {
+    attr->mode = MF_MODE_LOCKED;
+    attr->slot_size = MF_MPMC_SLOT;
+    attr->nslots = 0;
+    attr->spin_count = -1;
+    attr->yield_count = -1;
+    attr->mirror = -1;
+    attr->trace = -1;
+    attr->lanes = 1;
+    attr->max_msgs = -1;
+    attr->credits = 0;
+    attr->high_wm = 0;
+    attr->low_wm = -1;
+}
+
+// parse "QUEUE <name> KEY=VALUE ..." from the config file into qconf
+static int mf_parse_queue_line(char *line, char *name, mf_qattr_t *attr) {
+    char *save, *tok;
+
+    mf_qattr_init(attr);
+    strtok_r(line, " \t\n", &save);  // the QUEUE keyword
+    tok = strtok_r(NULL, " \t\n", &save);
+    if (tok == NULL)
+        return -1;
+    strncpy(name, tok, MAX_MQNAMESIZE - 1);
+    name[MAX_MQNAMESIZE - 1] = '\0';
+
+    while ((tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        if (tok[0] == '#')
+            break;  // trailing comment
+        char *value = strchr(tok, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(tok, "MODE") == 0) {
+            if (strcmp(value, "LOCKED") == 0)
+                attr->mode = MF_MODE_LOCKED;
+            else if (strcmp(value, "SPSC") == 0)
+                attr->mode = MF_MODE_SPSC;
+            else if (strcmp(value, "MPMC") == 0)
+                attr->mode = MF_MODE_MPMC;
+            else if (strcmp(value, "BCAST") == 0)
+                attr->mode = MF_MODE_BCAST;
+            else if (strcmp(value, "FIXED") == 0)
+                attr->mode = MF_MODE_FIXED;
+            else
+                return -1;
+        } else if (strcmp(tok, "SLOT") == 0) {
+            attr->slot_size = atoi(value);
+        } else if (strcmp(tok, "NSLOTS") == 0) {
+            attr->nslots = atoi(value);
+        } else if (strcmp(tok, "SPIN") == 0) {
+            attr->spin_count = atoi(value);
+        } else if (strcmp(tok, "YIELD") == 0) {
+            attr->yield_count = atoi(value);
+        } else if (strcmp(tok, "MIRROR") == 0) {
+            attr->mirror = atoi(value) != 0;
+        } else if (strcmp(tok, "TRACE") == 0) {
+            attr->trace = atoi(value) != 0;
+        } else if (strcmp(tok, "LANES") == 0) {
+            attr->lanes = atoi(value);
+        } else if (strcmp(tok, "MAXMSGS") == 0) {
+            attr->max_msgs = atoi(value);
+        } else if (strcmp(tok, "CREDITS") == 0) {
+            attr->credits = atoi(value);
+        } else if (strcmp(tok, "HIGH") == 0) {
+            attr->high_wm = atoi(value);
+        } else if (strcmp(tok, "LOW") == 0) {
+            attr->low_wm = atoi(value);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Buddy allocator over each segment of the region. A segment is cut
+// into blocks of MF_BUDDY_MIN << order bytes, each aligned to its own
+// size from the segment start, so a block's buddy is at off ^ size.
+// Free blocks sit on per-segment, per-order doubly linked lists threaded
+// through the blocks themselves; the order map at the start of the
+// segment (in the root one, right after the metadata) keeps, for every
+// MF_BUDDY_MIN unit that starts a block, its order and whether it is
+// free or a blob. Offsets are region offsets. All callers hold the
+// global lock and have the segment mapped.
+#define MF_BLOCK_FREE 0x80
+#define MF_BLOCK_BLOB 0x40  // a blob in use, see mf_blob_alloc()
+#define MF_BLOCK_ORDER 0x3f
+
+typedef struct {
+    int next;  // offsets, 0 ends the list (offset 0 is the metadata)
+    int prev;
+} mf_free_block_t;
+
+static unsigned char *mf_buddy_map(int seg) {
+    return (unsigned char *)mf_segs[seg].addr + (seg == 0 ? sizeof(shmem_metadata_t) : 0);
+}
+
+// the order map entry of the block at region offset off
+static unsigned char *mf_buddy_unit(int off) {
+    return &mf_buddy_map(off >> MF_SEG_SHIFT)[(off & MF_SEG_MASK) / MF_BUDDY_MIN];
+}
+
+static mf_free_block_t *mf_block_at(int off) {
+    return (mf_free_block_t *)mf_at(off);
+}
+
+static void mf_buddy_push(int off, int order) {
+    mf_free_block_t *block = mf_block_at(off);
+    int *head = &shmem_metadata->buddy_free[off >> MF_SEG_SHIFT][order];
+
+    block->next = *head;
+    block->prev = 0;
+    if (*head != 0)
+        mf_block_at(*head)->prev = off;
+    *head = off;
+    *mf_buddy_unit(off) = order | MF_BLOCK_FREE;
+}
+
+static void mf_buddy_unlink(int off, int order) {
+    mf_free_block_t *block = mf_block_at(off);
+
+    if (block->prev != 0)
+        mf_block_at(block->prev)->next = block->next;
+    else
+        shmem_metadata->buddy_free[off >> MF_SEG_SHIFT][order] = block->next;
+    if (block->next != 0)
+        mf_block_at(block->next)->prev = block->prev;
+    *mf_buddy_unit(off) = order;  // start of a used block
+}
+
+// order of the largest block mf_buddy_init cuts from a segment of size
+// bytes, the root one if root; -1 if none
+static int mf_buddy_top_order(int size, int root) {
+    int off = ((root ? sizeof(shmem_metadata_t) : 0) + size / MF_BUDDY_MIN + MF_BUDDY_MIN - 1) & ~(MF_BUDDY_MIN - 1);
+    int top = -1;
+
+    while (off + MF_BUDDY_MIN <= size) {
+        int order = 0;
+        while (order + 1 < MF_BUDDY_ORDERS && off % (MF_BUDDY_MIN << (order + 1)) == 0 &&
+               off + (MF_BUDDY_MIN << (order + 1)) <= size)
+            order++;
+        if (order > top)
+            top = order;
+        off += MF_BUDDY_MIN << order;
+    }
+    return top;
+}
+
+// hand everything of segment seg past the metadata and the order map to
+// the free lists as the largest aligned blocks that fit
+static void mf_buddy_init(int seg) {
+    int size = shmem_metadata->seg_size[seg];
+    int units = size / MF_BUDDY_MIN;
+    int off = ((char *)mf_buddy_map(seg) - mf_segs[seg].addr + units + MF_BUDDY_MIN - 1) & ~(MF_BUDDY_MIN - 1);
+
+    memset(shmem_metadata->buddy_free[seg], 0, sizeof(shmem_metadata->buddy_free[seg]));
+    memset(mf_buddy_map(seg), 0, units);
+    while (off + MF_BUDDY_MIN <= size) {
+        int order = 0;
+        while (order + 1 < MF_BUDDY_ORDERS && off % (MF_BUDDY_MIN << (order + 1)) == 0 &&
+               off + (MF_BUDDY_MIN << (order + 1)) <= size)
+            order++;
+        mf_buddy_push((seg << MF_SEG_SHIFT) | off, order);
+        off += MF_BUDDY_MIN << order;
+    }
+}
+
+// offset of a block of at least size bytes in segment seg, or 0 when
+// none is free
+static int mf_buddy_alloc(int seg, size_t size) {
+    int *free_list = shmem_metadata->buddy_free[seg];
+    int order = 0, k;
+
+    while ((MF_BUDDY_MIN << order) < size)
+        if (++order == MF_BUDDY_ORDERS)
+            return 0;
+    for (k = order; k < MF_BUDDY_ORDERS && free_list[k] == 0; k++)
+        ;
+    if (k == MF_BUDDY_ORDERS)
+        return 0;
+
+    int off = free_list[k];
+    mf_buddy_unlink(off, k);
+    while (k > order) {  // split, keeping the lower half
+        k--;
+        mf_buddy_push(off + (MF_BUDDY_MIN << k), k);
+    }
+    *mf_buddy_unit(off) = order;
+    return off;
+}
+
+static void mf_buddy_free(int off) {
+    int seg_off = off & ~MF_SEG_MASK, size = shmem_metadata->seg_size[off >> MF_SEG_SHIFT];
+    int order = *mf_buddy_unit(off);
+
+    // merge with the buddy for as long as it is free and whole
+    off &= MF_SEG_MASK;
+    while (order + 1 < MF_BUDDY_ORDERS) {
+        int buddy = off ^ (MF_BUDDY_MIN << order);
+        if (buddy + (MF_BUDDY_MIN << order) > size ||
+            *mf_buddy_unit(seg_off | buddy) != (order | MF_BLOCK_FREE))
+            break;
+        mf_buddy_unlink(seg_off | buddy, order);
+        *mf_buddy_unit(seg_off | buddy) = 0;
+        off &= ~(MF_BUDDY_MIN << order);
+        order++;
+    }
+    mf_buddy_push(seg_off | off, order);
+}
+
+// mfserver hands out readiness eventfds on an abstract unix socket named
+// after the shared memory region
+static socklen_t mf_sock_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "mf%s", shmem_name);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + min(len, (int)sizeof(addr->sun_path) - 2);
+}
+
+// a robust process-shared mutex, see mf_global_lock and mf_queue_lock
+static int mf_mutex_init(pthread_mutex_t *lock) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+// config keys about backing, mapping and growing the region, read by
+// mf_init and published in the header; returns 1 if key was one of them
+static int mf_parse_map_key(const char *key, const char *value) {
+    if (strcmp(key, "HUGE_PAGES") == 0) {
+        huge_pages = atoi(value) != 0;
+    } else if (strcmp(key, "HUGETLB_DIR") == 0) {
+        strncpy(hugetlb_dir, value, sizeof(hugetlb_dir) - 1);
+        hugetlb_dir[sizeof(hugetlb_dir) - 1] = '\0';
+    } else if (strcmp(key, "PREFAULT") == 0) {
+        prefault = atoi(value) != 0;
+    } else if (strcmp(key, "MLOCK") == 0) {
+        lock_pages = atoi(value) != 0;
+    } else if (strcmp(key, "MAX_SEGMENTS") == 0) {
+        max_segs = atoi(value);
+    } else if (strcmp(key, "SEGMENT_SIZE") == 0) {
+        seg_grow = atoi(value) * 1024;  // KB
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// POSIX shm name of segment seg: SHMEM_NAME for the root one, then
+// SHMEM_NAME.1, SHMEM_NAME.2, ...
+static void mf_seg_name(int seg, char *name, size_t len) {
+    if (seg == 0)
+        snprintf(name, len, "%s", shmem_name);
+    else
+        snprintf(name, len, "%s.%d", shmem_name, seg);
+}
+
+// the hugetlbfs file for the shm name
+static void mf_huge_path(const char *name, char *path, size_t len) {
+    snprintf(path, len, "%s/%s", hugetlb_dir, name[0] == '/' ? name + 1 : name);
+}
+
+// open (and with create, size) the hugetlbfs file for a segment and map
+// it; MAP_FAILED when there is no hugetlbfs or no free huge pages
+static void *mf_map_huge(const char *name, int size, int create, int prot, mf_seg_t *map) {
+    char path[3 * MAXFILENAME];
+    struct statfs sfs;
+    void *addr = MAP_FAILED;
+
+    mf_huge_path(name, path, sizeof(path));
+    map->fd = open(path, ((prot & PROT_WRITE) ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0), 0666);
+    if (map->fd != -1 && fstatfs(map->fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+        map->size = (size + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+        if (!create || ftruncate(map->fd, map->size) == 0)
+            addr = mmap(NULL, map->size, prot, MAP_SHARED | (prefault ? MAP_POPULATE : 0), map->fd, 0);
+    }
+    if (addr == MAP_FAILED && map->fd != -1) {
+        close(map->fd);
+        if (create)
+            unlink(path);
+    }
+    return addr;
+}
+
+// map segment seg (with create, make it first): on hugetlbfs if huge
+// and huge pages are to be had, else on POSIX shm with a transparent
+// huge page hint if HUGE_PAGES; prefaulted by PREFAULT and locked by
+// MLOCK. Fills map; -1 with a message on failure.
+static int mf_map_region(int seg, int size, int create, int prot, int huge, mf_seg_t *map) {
+    char name[MAXFILENAME + 16];
+    void *addr;
+
+    mf_seg_name(seg, name, sizeof(name));
+    map->huge = huge;
+    addr = huge ? mf_map_huge(name, size, create, prot, map) : MAP_FAILED;
+    if (addr == MAP_FAILED) {
+        map->huge = 0;
+        map->size = size;
+        map->fd = shm_open(name, ((prot & PROT_WRITE) ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0), 0666);
+        if (map->fd == -1) {
+            perror("Error accessing shared memory");
+            return -1;
+        }
+        if (create && ftruncate(map->fd, size) == -1) {
+            perror("Error setting shared memory size");
+            shm_unlink(name);  // Cleanup on failure
+            close(map->fd);
+            return -1;
+        }
+        addr = mmap(NULL, size, prot, MAP_SHARED | (prefault ? MAP_POPULATE : 0), map->fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("Error mapping shared memory");
+            if (create)
+                shm_unlink(name);
+            close(map->fd);
+            return -1;
+        }
+        if (huge_pages)
+            madvise(addr, size, MADV_HUGEPAGE);  // used if shmem THP is set to advise
+    }
+
+    if (lock_pages && mlock(addr, map->size) == -1)
+        perror("Warning: cannot mlock shared memory");  // see RLIMIT_MEMLOCK
+    map->addr = addr;
+    return 0;
+}
+
+// remove the shm object or hugetlbfs file of segment seg
+static int mf_unlink_seg(int seg, int huge) {
+    char name[MAXFILENAME + 16], path[3 * MAXFILENAME];
+
+    mf_seg_name(seg, name, sizeof(name));
+    if (!huge)
+        return shm_unlink(name);
+    mf_huge_path(name, path, sizeof(path));
+    return unlink(path);
+}
+
+static void mf_unmap_segs() {
+    for (int i = 0; i < MF_MAX_SEGMENTS; i++) {
+        if (mf_segs[i].addr == NULL)
+            continue;
+        munmap(mf_segs[i].addr, mf_segs[i].size);
+        close(mf_segs[i].fd);
+        mf_segs[i].addr = NULL;
+    }
+    shm_fd = -1;
+}
+
+// make sure segment seg, which some process added, is mapped here. One
+// thread maps it while others racing for it wait: fd, size and huge are
+// filled in before addr is published, so whoever sees addr may use them.
+static int mf_seg_map(int seg) {
+    mf_seg_t map;
+
+    for (;;) {
+        if (__atomic_load_n(&mf_segs[seg].addr, __ATOMIC_ACQUIRE) != NULL)
+            return 0;
+        if (seg >= __atomic_load_n(&shmem_metadata->num_segs, __ATOMIC_ACQUIRE)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (__atomic_exchange_n(&mf_segs[seg].busy, 1, __ATOMIC_ACQUIRE) == 0)
+            break;
+        sched_yield();
+    }
+    int rc = 0;
+    if (mf_segs[seg].addr == NULL) {  // else mapped before we got busy
+        rc = mf_map_region(seg, shmem_metadata->seg_size[seg], 0, mf_prot, shmem_metadata->seg_huge[seg], &map);
+        if (rc == 0) {
+            mf_segs[seg].fd = map.fd;
+            mf_segs[seg].size = map.size;
+            mf_segs[seg].huge = map.huge;
+            __atomic_store_n(&mf_segs[seg].addr, map.addr, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(&mf_segs[seg].busy, 0, __ATOMIC_RELEASE);
+    return rc;
+}
+
+// add a segment of SEGMENT_SIZE to the region, under the global
+// lock; returns it or -1 when MAX_SEGMENTS are in use. The queues
+// in the other segments keep running meanwhile.
+static int mf_seg_grow() {
+    int seg = shmem_metadata->num_segs;
+
+    if (seg >= shmem_metadata->max_segs)
+        return -1;
+    if (mf_segs[seg].addr != NULL) {  // left from a removed region
+        munmap(mf_segs[seg].addr, mf_segs[seg].size);
+        close(mf_segs[seg].fd);
+        mf_segs[seg].addr = NULL;
+    }
+    if (mf_map_region(seg, shmem_metadata->seg_grow, 1, PROT_READ | PROT_WRITE, huge_pages, &mf_segs[seg]) == -1)
+        return -1;
+    shmem_metadata->seg_size[seg] = shmem_metadata->seg_grow;
+    shmem_metadata->seg_huge[seg] = mf_segs[seg].huge;
+    mf_buddy_init(seg);
+    __atomic_store_n(&shmem_metadata->num_segs, seg + 1, __ATOMIC_RELEASE);
+    printf("mf: added shared memory segment %d (%d KB)\n", seg, shmem_metadata->seg_grow / 1024);
+    return seg;
+}
 
 int mf_init() {
     FILE *config_file = fopen(CONFIG_FILENAME, "r");
@@ -37,11 +527,27 @@ int mf_init() {
     char local_shmem_name[256];  // use a local variable to avoid global conflicts
     int local_shmem_size = 0;    // local variable to hold the shared memory size
     int local_max_queues = 0;    // local variable to hold the max number of queues
+    int local_max_msgs = 0;      // MAX_MSGS_IN_QUEUE, 0 for no limit
+    int wait_spin = MF_WAIT_SPIN;
+    int wait_yield = MF_WAIT_YIELD;
+    int mirror_rings = 0;
+    int trace_latency = 0;
+    char qconf_names[MF_MAX_QCONF][MAX_MQNAMESIZE];  // QUEUE entries, copied into the region below
+    mf_qattr_t qconf_attrs[MF_MAX_QCONF];
+    int num_qconf = 0;
 
     // reading configuration parameters
     while (fgets(line, sizeof(line), config_file)) {
         if (line[0] == '#' || isspace(line[0])) continue;  // ignore comments and blank lines
-        
+
+        if (strncmp(line, "QUEUE", 5) == 0 && isspace(line[5])) {
+            if (num_qconf == MF_MAX_QCONF || mf_parse_queue_line(line, qconf_names[num_qconf], &qconf_attrs[num_qconf]) != 0)
+                fprintf(stderr, "Ignoring queue entry in config file: %s", line);
+            else
+                num_qconf++;
+            continue;
+        }
+
         if (sscanf(line, "%s %s", key, value) != 2) {
             fprintf(stderr, "Malformed line in config file: %s", line);
             continue;  
@@ -54,63 +560,113 @@ int mf_init() {
             local_shmem_size = atoi(value) * 1024;  // convert KB to bytes
         } else if (strcmp(key, "MAX_QUEUES_IN_SHMEM") == 0) {
             local_max_queues = atoi(value);  // read maximum number of queues
+        } else if (strcmp(key, "MAX_MSGS_IN_QUEUE") == 0) {
+            local_max_msgs = atoi(value);
+        } else if (strcmp(key, "WAIT_SPIN") == 0) {
+            wait_spin = atoi(value);
+        } else if (strcmp(key, "WAIT_YIELD") == 0) {
+            wait_yield = atoi(value);
+        } else if (strcmp(key, "MIRROR_RINGS") == 0) {
+            mirror_rings = atoi(value) != 0;
+        } else if (strcmp(key, "TRACE_LATENCY") == 0) {
+            trace_latency = atoi(value) != 0;
+        } else {
+            mf_parse_map_key(key, value);
         }
     }
     fclose(config_file);
 
     // ensure all necessary configuration parameters were successfully read
-    if (local_shmem_name[0] == '\0' || local_shmem_size <= 0 || local_max_queues <= 0) {
+    if (local_shmem_name[0] == '\0' || local_shmem_size <= 0 || local_max_queues <= 0 ||
+        local_max_queues > MF_MAX_QUEUES || local_max_msgs < 0) {
         fprintf(stderr, "Configuration incomplete or invalid.\n");
         return -1;
     }
-
-    // create or open the shared memory object
-    shm_fd = shm_open(local_shmem_name, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("Error creating or accessing shared memory");
-        return -1;
-    }
-
-    // set the size of the shared memory object
-    if (ftruncate(shm_fd, local_shmem_size) == -1) {
-        perror("Error setting shared memory size");
-        shm_unlink(local_shmem_name);  // Cleanup on failure
-        close(shm_fd);
+    if (seg_grow == 0)
+        seg_grow = local_shmem_size;
+    if (local_shmem_size > MAX_SHMEMSIZE * 1024 || seg_grow < MIN_SHMEMSIZE * 1024 ||
+        seg_grow > MAX_SHMEMSIZE * 1024 || max_segs < 1 || max_segs > MF_MAX_SEGMENTS) {
+        fprintf(stderr, "SHMEM_SIZE, SEGMENT_SIZE or MAX_SEGMENTS out of bounds.\n");
         return -1;
     }
 
-    // Map the shared memory object
-    global_shmem_addr = mmap(NULL, local_shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (global_shmem_addr == MAP_FAILED) {
-        perror("Error mapping shared memory");
-        shm_unlink(local_shmem_name);  // Cleanup on failure
-        close(shm_fd);
+    // create, size and map the shared memory object, the root segment
+    strcpy(shmem_name, local_shmem_name);  // Store the name globally
+    mf_prot = PROT_READ | PROT_WRITE;
+    if (mf_map_region(0, local_shmem_size, 1, mf_prot, huge_pages, &mf_segs[0]) == -1)
         return -1;
-    }
+    global_shmem_addr = mf_segs[0].addr;
+    shm_fd = mf_segs[0].fd;
 
     global_shmem_size = local_shmem_size;  // Store the size globally
-    strcpy(shmem_name, local_shmem_name);  // Store the name globally
     shmem_size = local_shmem_size;         // Store the size globally
     shmem_addr = global_shmem_addr;        // Align local pointer to global pointer
     max_queues_in_shmem = local_max_queues; // Store the maximum number of queues globally
+    max_msgs_in_queue = local_max_msgs;
 
-    // Setup the metadata structure at the beginning of the shared memory
+    // Setup the metadata structure at the beginning of the shared memory;
+    // clients find everything they need to attach in its header
     shmem_metadata = (shmem_metadata_t *)global_shmem_addr;
+    shmem_metadata->magic = 0;  // a region left by a dead mfserver is not valid yet
+    shmem_metadata->version = MF_LAYOUT_VERSION;
+    shmem_metadata->header_size = sizeof(shmem_metadata_t);
+    shmem_metadata->region_size = local_shmem_size;
+    shmem_metadata->max_queues = local_max_queues;
+    shmem_metadata->max_msgs = local_max_msgs;
+    shmem_metadata->huge_pages = huge_pages;
+    shmem_metadata->prefault = prefault;
+    shmem_metadata->lock_pages = lock_pages;
+    strcpy(shmem_metadata->hugetlb_dir, hugetlb_dir);
     shmem_metadata->num_queues = 0;  // Initialize current queue count to 0
+    memset(shmem_metadata->queue_off, 0, sizeof(shmem_metadata->queue_off));
+    memset(shmem_metadata->queue_gen, 0, sizeof(shmem_metadata->queue_gen));
+    memset(shmem_metadata->dir, 0, sizeof(shmem_metadata->dir));
+    memset(shmem_metadata->blob_free, 0, sizeof(shmem_metadata->blob_free));
+    shmem_metadata->blobs = 0;
+    shmem_metadata->blob_bytes = 0;
+    shmem_metadata->next_slot = 0;
+    shmem_metadata->dir_seq = 0;
+    shmem_metadata->dir_recoveries = 0;
+    shmem_metadata->num_segs = 1;
+    shmem_metadata->max_segs = max_segs;
+    shmem_metadata->seg_grow = seg_grow;
+    shmem_metadata->seg_size[0] = local_shmem_size;
+    shmem_metadata->seg_huge[0] = mf_segs[0].huge;
+    mf_buddy_init(0);
+    shmem_metadata->num_qconf = num_qconf;
+    shmem_metadata->wait_spin = wait_spin;
+    shmem_metadata->wait_yield = wait_yield;
+    shmem_metadata->mirror_rings = mirror_rings;
+    shmem_metadata->trace_latency = trace_latency;
+    for (int i = 0; i < num_qconf; i++) {
+        strcpy(shmem_metadata->qconf[i].name, qconf_names[i]);
+        shmem_metadata->qconf[i].attr = qconf_attrs[i];
+    }
 
     // Print debugging information
     printf("mf_init: Shared Memory Address: %p, Size: %d, Max Queues: %d\n", global_shmem_addr, global_shmem_size, max_queues_in_shmem);
 
-    // Initialize global semaphore for synchronization
-    semaphore_id = sem_open("/global_semaphore", O_CREAT, 0644, 1);
-    if (semaphore_id == SEM_FAILED) {
-        perror("Error opening global semaphore");
-        munmap(global_shmem_addr, local_shmem_size);
-        shm_unlink(local_shmem_name);
-        close(shm_fd);
+    // the global lock only guards directory changes (create/remove),
+    // each queue carries its own lock
+    if (mf_mutex_init(&shmem_metadata->dir_lock) == -1) {
+        perror("Error initializing the directory lock");
+        mf_unlink_seg(0, mf_segs[0].huge);
+        mf_unmap_segs();
         return -1;
     }
-    sem_post(semaphore_id);
+
+    // the socket mf_get_fd asks for readiness fds on
+    struct sockaddr_un addr;
+    socklen_t addr_len = mf_sock_addr(&addr);
+    mf_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (mf_listen_fd >= 0 && (bind(mf_listen_fd, (struct sockaddr *)&addr, addr_len) == -1 ||
+                              listen(mf_listen_fd, 64) == -1)) {
+        perror("Error binding the readiness socket");  // mf_get_fd will fail
+        close(mf_listen_fd);
+        mf_listen_fd = -1;
+    }
+
+    __atomic_store_n(&shmem_metadata->magic, MF_MAGIC, __ATOMIC_RELEASE);
     return 0;  // Success
 }
 
@@ -119,311 +675,2829 @@ int mf_init() {
 int mf_destroy() {
     int cleanup_status = 0;
 
-    // unlink global named semaphore
-    if (sem_unlink("/global_semaphore") == -1) {
-        perror("Error unlinking mutex semaphore");
-        cleanup_status = -1;
-    }
-    // unmap the shared memory
-    if (munmap(shmem_addr, shmem_size) == -1) {
-        perror("Error unmapping shared memory");
-        cleanup_status = -1;
-    }
-
-    // remove the shared memory segment
-    if (shm_unlink(shmem_name) == -1) {
+    if (mf_listen_fd >= 0)
+        close(mf_listen_fd);
+    mf_listen_fd = -1;
+
+    // remove the segments; those added by clients may be on hugetlbfs or
+    // not whatever the root one is
+    shmem_metadata->magic = 0;
+    for (int i = 1; i < shmem_metadata->num_segs; i++)
+        if (mf_unlink_seg(i, shmem_metadata->seg_huge[i]) == -1)
+            perror("Error removing shared memory segment");
+    if (mf_unlink_seg(0, mf_segs[0].huge) == -1) {
         perror("Error removing shared memory");
         cleanup_status = -1;
     }
 
+    // unmap the shared memory
+    mf_unmap_segs();
+
     return cleanup_status;
 }
 
-int mf_connect() {
-    printf("mf connect starts..\n");
-
-    FILE *config_file = fopen(CONFIG_FILENAME, "r");
-    if (config_file == NULL) {
-        perror("Error opening config file");
-        return -1;
-    }
-
-    char line[256], key[256], value[256];
-    char local_shmem_name[256];  // local variable to hold the shared memory name
-    int local_shmem_size = 0;    // local variable to hold the shared memory size
-
-    // read configuration settings
-    while (fgets(line, sizeof(line), config_file)) {
-        if (line[0] == '#' || isspace(line[0])) continue; // skip comments and blank lines
-        
-        if (sscanf(line, "%s %s", key, value) != 2) {
-            fprintf(stderr, "Malformed line in config file: %s", line);
-            continue; // Skip malformed lines
+// the shm name (and hugetlbfs directory) of the region for a client
+// that did not name it: the environment, else an mf.config in the
+// current directory, else the defaults. Only those two keys are read.
+static void mf_region_name() {
+    char line[256], key[MAXFILENAME], value[MAXFILENAME];
+    const char *env = getenv(MF_SHMEM_NAME_ENV);
+
+    snprintf(shmem_name, sizeof(shmem_name), "%s", MF_DEFAULT_SHMEM_NAME);
+    FILE *config_file = env == NULL ? fopen(CONFIG_FILENAME, "r") : NULL;
+    if (config_file != NULL) {
+        while (fgets(line, sizeof(line), config_file)) {
+            if (line[0] == '#' || isspace(line[0]) || sscanf(line, "%127s %127s", key, value) != 2)
+                continue;
+            if (strcmp(key, "SHMEM_NAME") == 0)
+                strcpy(shmem_name, value);
+            else if (strcmp(key, "HUGETLB_DIR") == 0)
+                strcpy(hugetlb_dir, value);
         }
+        fclose(config_file);
+    }
+    if (env != NULL)
+        snprintf(shmem_name, sizeof(shmem_name), "%s", env);
+    if ((env = getenv(MF_HUGETLB_DIR_ENV)) != NULL)
+        snprintf(hugetlb_dir, sizeof(hugetlb_dir), "%s", env);
+}
 
-        if (strcmp(key, "SHMEM_NAME") == 0) {
-            strncpy(local_shmem_name, value, sizeof(local_shmem_name) - 1);
-            local_shmem_name[sizeof(local_shmem_name) - 1] = '\0';
-        } else if (strcmp(key, "SHMEM_SIZE") == 0) {
-            local_shmem_size = atoi(value) * 1024; // Convert KB to bytes
-        }
+// map the root segment of the region named shmem_name with prot and
+// take the rest from its header; the descriptor stays open for mapping
+// mirrored queue buffers later
+static int mf_attach(int prot) {
+    char path[3 * MAXFILENAME];
+    mf_seg_t *map = &mf_segs[0];
+    struct stat st;
+    int oflag = (prot & PROT_WRITE) ? O_RDWR : O_RDONLY;
+
+    // a POSIX shm object, or a file on hugetlbfs if mfserver got huge pages
+    map->huge = 0;
+    map->fd = shm_open(shmem_name, oflag, 0);
+    if (map->fd == -1 && errno == ENOENT) {
+        mf_huge_path(shmem_name, path, sizeof(path));
+        map->fd = open(path, oflag);
+        map->huge = 1;
     }
-    fclose(config_file);
-    semaphore_id = sem_open("/global_semaphore", O_CREAT, 0644, 1);
-    // ensure that the configuration parameters were successfully read
-    if (local_shmem_name[0] == '\0' || local_shmem_size <= 0) {
-        fprintf(stderr, "Configuration incomplete or invalid.\n");
+    if (map->fd == -1) {
+        perror("Error accessing shared memory");
         return -1;
     }
-
-    // attach to the existing shared memory segment
-    int shm_fd = shm_open(local_shmem_name, O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("Error accessing shared memory");
+    if (fstat(map->fd, &st) == -1 || st.st_size < (off_t)sizeof(shmem_metadata_t)) {
+        fprintf(stderr, "Shared memory %s is not an MF region.\n", shmem_name);
+        close(map->fd);
+        errno = EPROTO;
         return -1;
     }
-
-    void *temp_addr = mmap(NULL, local_shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (temp_addr == MAP_FAILED) {
+    map->size = st.st_size;
+    map->addr = mmap(NULL, map->size, prot, MAP_SHARED, map->fd, 0);
+    if (map->addr == MAP_FAILED) {
         perror("Error mapping shared memory");
-        close(shm_fd);  // properly close the file descriptor if mmap fails
+        close(map->fd);
+        map->addr = NULL;
         return -1;
     }
 
-    // correctly update global address and size
-    global_shmem_addr = temp_addr;
-    global_shmem_size = local_shmem_size;  // ensure the global size is updated to reflect the actual mapped size
+    shmem_metadata_t *hdr = (shmem_metadata_t *)map->addr;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MF_MAGIC || hdr->version != MF_LAYOUT_VERSION ||
+        hdr->header_size != (int)sizeof(shmem_metadata_t) || hdr->region_size > map->size) {
+        if (hdr->magic != MF_MAGIC)
+            fprintf(stderr, "Shared memory %s is not an MF region, or mfserver is starting.\n", shmem_name);
+        else
+            fprintf(stderr, "Shared memory %s has layout version %d, this library speaks %d.\n",
+                    shmem_name, hdr->version, MF_LAYOUT_VERSION);
+        munmap(map->addr, map->size);
+        close(map->fd);
+        map->addr = NULL;
+        errno = EPROTO;
+        return -1;
+    }
 
+    // the mapping options mfserver was configured with, for this segment
+    // and the ones mapped or added later
+    huge_pages = hdr->huge_pages;
+    prefault = hdr->prefault;
+    lock_pages = hdr->lock_pages;
+    snprintf(hugetlb_dir, sizeof(hugetlb_dir), "%s", hdr->hugetlb_dir);
+    if (huge_pages && !map->huge)
+        madvise(map->addr, map->size, MADV_HUGEPAGE);
+    if (prefault)
+        madvise(map->addr, map->size, (prot & PROT_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+    if (lock_pages && mlock(map->addr, map->size) == -1)
+        perror("Warning: cannot mlock shared memory");
+
+    mf_prot = prot;
+    shm_fd = map->fd;
+    global_shmem_addr = map->addr;
+    global_shmem_size = hdr->region_size;
     shmem_addr = global_shmem_addr;  // update the local pointer for internal use
     shmem_size = global_shmem_size;  // update the local size for internal use
+    max_queues_in_shmem = hdr->max_queues;
+    max_msgs_in_queue = hdr->max_msgs;
 
     // initialize metadata pointer
-    shmem_metadata = (shmem_metadata_t *)global_shmem_addr;
+    shmem_metadata = hdr;
+    mf_stat_slot = getpid() % MF_STAT_SLOTS;
+    memset(mf_subs, 0, sizeof(mf_subs));  // a forked child subscribes on its own
+    return 0;
+}
+
+int mf_connect() {
+    printf("mf connect starts..\n");
 
-    // close the file descriptor after successful mmap
-    close(shm_fd);
+    mf_region_name();
+    if (mf_attach(PROT_READ | PROT_WRITE) != 0)
+        return -1;
 
     printf("MFCONNECT Shared Memory Address: %p, Size: %d\n", global_shmem_addr, global_shmem_size);
     printf("mf connect ends..\n");
     return 0;
 }
 
+// a connection that can only look: mf_get_stats, mf_list and mf_print
+// work, sends and receives fault
+int mf_connect_readonly() {
+    mf_region_name();
+    return mf_attach(PROT_READ);
+}
+
+// mf_connect without looking at the environment or any config file
+int mf_connect_name(const char *shm_name) {
+    snprintf(shmem_name, sizeof(shmem_name), "%s", shm_name);
+    return mf_attach(PROT_READ | PROT_WRITE);
+}
+
+// Mirrored rings: a process maps the buffer of a byte ring queue twice,
+// back to back, so a record that runs past the end of the buffer
+// continues in the second mapping and every copy is one memcpy. The
+// bytes in shared memory are the same either way, so processes with and
+// without the mirror can share a queue. Mappings are made lazily by
+// mf_queue_at and remembered per table slot together with the qid they
+// were made for.
+static struct {
+    int qid;     // queue the mapping belongs to, 0 for none
+    char *addr;  // NULL if the queue is not mirrored in this process
+    int size;
+} mf_mirrors[MF_MAX_QUEUES];
+
+static void mf_unmap_mirror(int slot) {
+    if (mf_mirrors[slot].addr != NULL)
+        munmap(mf_mirrors[slot].addr, 2 * mf_mirrors[slot].size);
+    mf_mirrors[slot].addr = NULL;
+    mf_mirrors[slot].qid = 0;
+}
+
+static void mf_unmap_mirrors() {
+    for (int i = 0; i < MF_MAX_QUEUES; i++)
+        mf_unmap_mirror(i);
+}
+
+static void mf_map_mirror(int slot, int qid, mf_queue_t *queue) {
+    mf_seg_t *seg = &mf_segs[queue->buffer_off >> MF_SEG_SHIFT];
+    int off = queue->buffer_off & MF_SEG_MASK;  // in the segment's file
+
+    mf_unmap_mirror(slot);  // the slot's previous queue is gone
+    mf_mirrors[slot].qid = qid;
+    if (seg->addr == NULL)
+        return;
+
+    // reserve twice the size, then put the buffer in both halves
+    char *base = mmap(NULL, 2 * queue->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return;
+    // (on hugetlbfs this fails unless the buffer sits on a huge page boundary)
+    int flags = MAP_SHARED | MAP_FIXED | (prefault ? MAP_POPULATE : 0);
+    if (mmap(base, queue->size, PROT_READ | PROT_WRITE, flags, seg->fd, off) == MAP_FAILED ||
+        mmap(base + queue->size, queue->size, PROT_READ | PROT_WRITE, flags, seg->fd, off) == MAP_FAILED) {
+        munmap(base, 2 * queue->size);
+        return;  // fall back to split copies
+    }
+    mf_mirrors[slot].addr = base;
+    mf_mirrors[slot].size = queue->size;
+}
+
 int mf_disconnect() {
     extern void *global_shmem_addr;  // Pointer to the shared memory
     extern int global_shmem_size;    // Size of the shared memory
     extern int shm_fd;               // File descriptor for the shared memory
 
-    // Unmap the shared memory
-    if (munmap(global_shmem_addr, global_shmem_size) == -1) {
-        perror("Error unmapping shared memory");
-        return -1;
-    }
-
-    // Close the shared memory file descriptor
-    if (close(shm_fd) == -1) {
-        perror("Error closing shared memory descriptor");
-        return -1;
-    }
+    // hand back unspent credits, then unmap the shared memory, every
+    // segment this process mapped
+    mf_msgs_return_all();
+    mf_unmap_mirrors();
+    mf_unmap_segs();
 
     // Optionally, here you would also decrement a count of connected processes
     // and only call mf_destroy() if it's the last one.
     // This part depends on whether you are keeping track of active processes.
-    shmem_metadata->num_queues--;
     return 0;
 }
 
-int mf_create(char *mqname, int mqsize) {
-    printf("mf create starts..\n");
+// the queue header at region offset off, mapping its segment if this
+// process has not yet; NULL with errno if that fails
+static inline mf_queue_t *mf_queue_hdr(int off) {
+    if (__builtin_expect(mf_segs[off >> MF_SEG_SHIFT].addr == NULL, 0) && mf_seg_map(off >> MF_SEG_SHIFT) == -1)
+        return NULL;
+    return (mf_queue_t *)mf_at(off);
+}
 
-    // acquire the global semaphore to ensure access to the shared memory
-    sem_wait(semaphore_id);
+// queue headers and buffers are blocks of a buddy allocator over the
+// region. returns the queue for qid or NULL with errno EINVAL for a qid
+// that never was valid and ESTALE for one whose queue was removed.
+static mf_queue_t *mf_queue_lookup(int qid) {
+    int slot = (qid & ((1 << MF_QID_SHIFT) - 1)) - 1;
 
-    // validation of mqsize (converted from KB to bytes for internal calculation)
-    int buffer_size = mqsize * 1024; // mqsize specified in KB, converted to bytes
-    if (mqsize < MIN_MQSIZE || mqsize > MAX_MQSIZE || buffer_size % 4096 != 0) {
-        fprintf(stderr, "Queue size %d KB is out of bounds or not a multiple of 4KB.\n", mqsize);
-        sem_post(semaphore_id);
-        return -1;
+    if (qid < 1 || slot < 0 || slot >= MF_MAX_QUEUES) {
+        errno = EINVAL;
+        return NULL;
     }
+    if (shmem_metadata->queue_off[slot] == 0 || shmem_metadata->queue_gen[slot] != qid >> MF_QID_SHIFT) {
+        errno = ESTALE;
+        return NULL;
+    }
+    return mf_queue_hdr(shmem_metadata->queue_off[slot]);
+}
 
-    // check if there is enough space left in the shared memory
-    size_t offset = sizeof(shmem_metadata_t) + (shmem_metadata->num_queues * sizeof(mf_queue_t));
-    if (offset + sizeof(mf_queue_t) + buffer_size > global_shmem_size) {
-        fprintf(stderr, "Not enough space in shared memory to create a new message queue.\n");
-        sem_post(semaphore_id);
-        return -1;
+// mf_queue_lookup for a send or receive: also maps a mirrored buffer
+static mf_queue_t *mf_queue_at(int qid) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue != NULL && queue->mirror && mf_mirrors[queue->slot].qid != qid)
+        mf_map_mirror(queue->slot, qid, queue);
+    return queue;
+}
+
+// The directory is an open-addressed hash (linear probing) from queue
+// name to table slot. Changes happen under the global lock and are
+// bracketed by dir_seq, so mf_open can look names up without any lock
+// and simply retry if a create/remove ran meanwhile.
+static unsigned int mf_name_hash(const char *name) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+// bucket holding name, or -1
+static int mf_dir_find(const char *name, unsigned int hash) {
+    mf_dirent_t *dir = shmem_metadata->dir;
+
+    for (int n = 0, i = hash & (MF_DIR_SIZE - 1); n < MF_DIR_SIZE; n++, i = (i + 1) & (MF_DIR_SIZE - 1)) {
+        int slot = dir[i].slot;
+        if (slot == 0)
+            return -1;
+        if (dir[i].hash != hash || slot > MF_MAX_QUEUES || shmem_metadata->queue_off[slot - 1] == 0)
+            continue;
+        mf_queue_t *queue = mf_queue_hdr(shmem_metadata->queue_off[slot - 1]);
+        if (queue != NULL && strncmp(queue->name, name, MAX_MQNAMESIZE) == 0)
+            return i;
     }
+    return -1;
+}
 
-    // setup  new queue at the calculated offset
-    mf_queue_t *new_queue = (mf_queue_t *)((char *)global_shmem_addr + offset);
-    strncpy(new_queue->name, mqname, MAX_MQNAMESIZE - 1);
-    new_queue->name[MAX_MQNAMESIZE - 1] = '\0';  // Ensure null termination
-    new_queue->size = buffer_size;
-    new_queue->in = 0;
-    new_queue->out = 0;
-    new_queue->ref_count = 0;
+static void mf_dir_begin() {
+    __atomic_store_n(&shmem_metadata->dir_seq, shmem_metadata->dir_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    // increment the number of queues
-    shmem_metadata->num_queues++;
-    printf("mf create: Queue created successfully. Total queues: %d\n", shmem_metadata->num_queues);
+static void mf_dir_end() {
+    __atomic_store_n(&shmem_metadata->dir_seq, shmem_metadata->dir_seq + 1, __ATOMIC_RELEASE);
+}
 
-    sem_post(semaphore_id);  // Release global semaphore
-    return 0;  // Success
+static void mf_dir_insert(unsigned int hash, int slot) {
+    mf_dirent_t *dir = shmem_metadata->dir;
+    int i = hash & (MF_DIR_SIZE - 1);
+
+    while (dir[i].slot != 0)  // never full: twice as many buckets as queues
+        i = (i + 1) & (MF_DIR_SIZE - 1);
+    dir[i].hash = hash;
+    dir[i].slot = slot + 1;
 }
 
-int mf_remove(char *mqname) {
-    // Acquire the semaphore
-    sem_wait(semaphore_id);
+// empty bucket i, shifting later entries of the probe run back so no
+// lookup stops early at the hole
+static void mf_dir_delete(int i) {
+    mf_dirent_t *dir = shmem_metadata->dir;
+    int j = i;
 
-    // Find the queue to remove
-    mf_queue_t *queue_to_remove = NULL;
-    size_t offset = sizeof(shmem_metadata_t);
-    for (int i = 0; i < shmem_metadata->num_queues; i++) {
-        mf_queue_t *queue = (mf_queue_t *)((char *)shmem_addr + offset);
-        if (strcmp(queue->name, mqname) == 0) {
-            queue_to_remove = queue;
+    for (;;) {
+        j = (j + 1) & (MF_DIR_SIZE - 1);
+        if (dir[j].slot == 0)
             break;
-        }
-        offset += sizeof(mf_queue_t);
+        int home = dir[j].hash & (MF_DIR_SIZE - 1);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;  // j is still reachable from its home bucket
+        dir[i] = dir[j];
+        i = j;
     }
+    dir[i].slot = 0;
+}
 
-    // If the queue is not found, return an error
-    if (queue_to_remove == NULL) {
-        sem_post(semaphore_id);
-        return -1;
+// Locks are robust process-shared mutexes: when a process dies holding
+// one, the kernel hands it to the next locker with EOWNERDEAD, which
+// repairs what the dead owner may have left half done, marks the lock
+// consistent again and counts the recovery.
+//
+// dir_lock guards create/remove, the buddy allocator and growing the
+// region. A directory change is bracketed by dir_seq, so an odd dir_seq
+// after a dead owner means the hash may be half changed: it is rebuilt
+// from the queue table. A buddy operation cut short can at worst lose
+// the blocks it was moving.
+static void mf_global_lock() {
+    if (pthread_mutex_lock(&shmem_metadata->dir_lock) != EOWNERDEAD)
+        return;
+    if (shmem_metadata->dir_seq & 1) {
+        int n = 0;
+        memset(shmem_metadata->dir, 0, sizeof(shmem_metadata->dir));
+        for (int slot = 0; slot < MF_MAX_QUEUES; slot++) {
+            mf_queue_t *queue = shmem_metadata->queue_off[slot] != 0 ? mf_queue_hdr(shmem_metadata->queue_off[slot]) : NULL;
+            if (queue == NULL)
+                continue;
+            mf_dir_insert(mf_name_hash(queue->name), slot);
+            n++;
+        }
+        shmem_metadata->num_queues = n;
+        mf_dir_end();
     }
+    shmem_metadata->dir_recoveries++;
+    pthread_mutex_consistent(&shmem_metadata->dir_lock);
+    fprintf(stderr, "mf: took over the directory lock from a dead process\n");
+}
 
-    // Remove the queue by shifting the remaining queues in memory
-    size_t remaining_bytes = (char *)shmem_addr + shmem_size - (char *)queue_to_remove - sizeof(mf_queue_t);
-    memmove(queue_to_remove, (char *)queue_to_remove + sizeof(mf_queue_t), remaining_bytes);
-
-    // Decrement the number of queues
-    shmem_metadata->num_queues--;
+static void mf_global_unlock() {
+    pthread_mutex_unlock(&shmem_metadata->dir_lock);
+}
 
-    // Release the semaphore
-    sem_post(semaphore_id);
+static inline int mf_make_qid(int slot) {
+    return (shmem_metadata->queue_gen[slot] << MF_QID_SHIFT) | (slot + 1);
+}
 
-    return 0;
+// the mirrored mapping of the queue buffer in this process, or NULL
+static inline char *mf_qmirror(mf_queue_t *queue) {
+    return queue->mirror ? mf_mirrors[queue->slot].addr : NULL;
 }
 
-int mf_open(char *mqname) {
-    printf("mf open starts... \n");
-    sem_wait(semaphore_id);  // Synchronize access
-    printf("mf open shmem_metadata->num_queues= %d \n",shmem_metadata->num_queues);
+static inline char *mf_qbuf(mf_queue_t *queue) {
+    char *mirror = mf_qmirror(queue);
+    return mirror != NULL ? mirror : mf_at(queue->buffer_off);
+}
 
-    for (int i = 0; i < shmem_metadata->num_queues; i++) {
-        printf("mf open for... \n");
-        mf_queue_t *queue = (mf_queue_t *)((char *)shmem_addr + sizeof(shmem_metadata_t) + i * sizeof(mf_queue_t));
-        if (strcmp(queue->name, mqname) == 0) {
-            sem_post(semaphore_id);
-            printf("open qid: %d \n", i + 1);
-            return i + 1;  // return the index (qid) of the found queue
-        }
-    }
-    printf("mf open starts... \n");
-    sem_post(semaphore_id);
-    return -1;  // queue not found
+// Latency tracing. A traced queue has queue->stamp bytes in front of
+// every payload, filled with the CLOCK_MONOTONIC time of the send (a
+// vDSO call, no syscall); receivers put the age of each message they
+// take into the histogram block at hist_off. An untraced queue has stamp
+// 0 and no histogram, so its only cost is the stamp == 0 tests.
+static inline unsigned long mf_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
-int mf_close(int qid) {
-    // Acquire the semaphore
-    sem_wait(semaphore_id);
+static inline mf_lat_hist_t *mf_qhist(mf_queue_t *queue) {
+    return (mf_lat_hist_t *)mf_at(queue->hist_off);
+}
 
-    // Calculate the offset of the queue based on the queue ID
-    size_t offset = sizeof(shmem_metadata_t) + qid * sizeof(mf_queue_t);
+static int mf_lat_bucket(unsigned long ns) {
+    if (ns < MF_LAT_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzl(ns) - MF_LAT_SUB_BITS;
+    int bucket = (shift + 1) * MF_LAT_SUB + (int)((ns >> shift) - MF_LAT_SUB);
+    return min(bucket, MF_LAT_BUCKETS - 1);
+}
 
-    // Check if the queue ID is valid
-    if (offset >= shmem_size || offset < sizeof(shmem_metadata_t)) {
-        sem_post(semaphore_id);
-        return -1;
-    }
+// smallest latency counted in bucket
+static unsigned long mf_lat_bucket_ns(int bucket) {
+    if (bucket < MF_LAT_SUB)
+        return bucket;
+    return (unsigned long)(MF_LAT_SUB + bucket % MF_LAT_SUB) << (bucket / MF_LAT_SUB - 1);
+}
 
-    mf_queue_t *queue = (mf_queue_t *)((char *)shmem_addr + offset);
+// count a message sent at stamp (from its record) as received now
+static void mf_lat_record(mf_queue_t *queue, const void *stamp) {
+    mf_lat_hist_t *hist = mf_qhist(queue);
+    unsigned long sent, now = mf_now_ns();
+
+    memcpy(&sent, stamp, sizeof(sent));  // only 4-byte aligned in a byte ring
+    unsigned long ns = now > sent ? now - sent : 0;
+    __atomic_add_fetch(&hist->buckets[mf_lat_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
 
-    // Release the semaphore
-    sem_post(semaphore_id);
+// MF_MODE_MPMC keeps nslots fixed-size slots in the buffer. Each slot
+// carries a sequence number: a sender may fill slot pos & mask when its
+// seq equals pos, a receiver may empty it when seq equals pos + 1, and
+// in/out are claimed with a compare-and-swap instead of the queue lock.
+typedef struct {
+    unsigned int seq;
+    int len;
+    char data[];
+} mf_slot_t;
+#define MF_SLOT_SKIP -1  // len of a cancelled reservation, see mf_send_cancel()
+
+static mf_slot_t *mf_slot_at(mf_queue_t *queue, unsigned int pos) {
+    return (mf_slot_t *)(mf_qbuf(queue) + (pos & (queue->nslots - 1)) * queue->slot_stride);
+}
 
-    return 0;
+// payload of a slot, past the send timestamp of a traced queue
+static inline char *mf_slot_data(mf_queue_t *queue, mf_slot_t *slot) {
+    return slot->data + queue->stamp;
 }
-int mf_send(int qid, void *bufptr, int datalen) {
-    if (datalen > MAX_DATALEN || datalen <= 0) {
-        fprintf(stderr, "Invalid data length.\n");
-        return -1;
-    }
 
-    sem_wait(semaphore_id); // Lock the global semaphore
+static void mf_slots_init(mf_queue_t *queue, int slot_size) {
+    int stride = (sizeof(mf_slot_t) + queue->stamp + slot_size + MF_CACHELINE - 1) & ~(MF_CACHELINE - 1);
+    int nslots = 1;
+    while (nslots * 2 * stride <= queue->size)
+        nslots *= 2;
+
+    queue->slot_size = slot_size;
+    queue->slot_stride = stride;
+    queue->nslots = nslots;
+    for (int i = 0; i < nslots; i++)
+        mf_slot_at(queue, i)->seq = i;
+}
 
-    mf_queue_t *queue = (mf_queue_t *)((char *)global_shmem_addr + sizeof(shmem_metadata_t) + (qid - 1) * sizeof(mf_queue_t));
-    int total_size = datalen + sizeof(int);  // Total size to store length + data
-    int next_in = (queue->in + total_size) % queue->size;
+// claim up to n consecutive free slots at in with one compare-and-swap;
+// returns how many (>= 1) with the first position in *posp, or -1 with
+// errno EAGAIN when the queue is full. the caller fills them and calls
+// mf_slot_publish on each.
+static int mf_slots_claim_in_n(mf_queue_t *queue, int n, unsigned int *posp) {
+    unsigned int pos = __atomic_load_n((unsigned int *)&queue->in, __ATOMIC_RELAXED);
+    for (;;) {
+        int dif = (int)(__atomic_load_n(&mf_slot_at(queue, pos)->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            int k = 1;
+            while (k < n && k < queue->nslots &&
+                   __atomic_load_n(&mf_slot_at(queue, pos + k)->seq, __ATOMIC_ACQUIRE) == pos + k)
+                k++;
+            if (__atomic_compare_exchange_n((unsigned int *)&queue->in, &pos, pos + k, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *posp = pos;
+                return k;  // slots are ours
+            }
+        } else if (dif < 0) {
+            errno = EAGAIN;
+            return -1;  // queue full
+        } else {
+            pos = __atomic_load_n((unsigned int *)&queue->in, __ATOMIC_RELAXED);
+        }
+    }
+}
 
-    if ((next_in == queue->out) || (queue->size - queue->in < total_size && queue->out < queue->in)) {
-        sem_post(semaphore_id);
-        printf("space exceeded!\n");
-        return -1; // Not enough space
+// claim the slot at in for a record of datalen; NULL with errno EAGAIN
+// when the queue is full. the caller fills it and calls mf_slot_publish.
+static mf_slot_t *mf_slots_claim_in(mf_queue_t *queue, int datalen, unsigned int *posp) {
+    if (datalen > queue->slot_size) {
+        errno = EMSGSIZE;
+        return NULL;
     }
+    if (mf_slots_claim_in_n(queue, 1, posp) < 0)
+        return NULL;
+    return mf_slot_at(queue, *posp);
+}
 
-    // store the message length first
-    char *queue_buffer = (char *)queue + sizeof(mf_queue_t);
-    if (queue->in + sizeof(int) > queue->size) {  // Check wrap-around for length
-        memcpy(queue_buffer + queue->in, &datalen, queue->size - queue->in);  // part before wrap
-        memcpy(queue_buffer, ((char*)&datalen) + (queue->size - queue->in), sizeof(int) - (queue->size - queue->in));  // part after wrap
-        queue->in = sizeof(int) - (queue->size - queue->in);
-    } else {
-        memcpy(queue_buffer + queue->in, &datalen, sizeof(int));
-        queue->in = (queue->in + sizeof(int)) % queue->size;
+static void mf_slot_publish(mf_queue_t *queue, mf_slot_t *slot, unsigned int pos, int datalen) {
+    if (queue->stamp) {
+        unsigned long now = mf_now_ns();
+        memcpy(slot->data, &now, sizeof(now));
     }
+    slot->len = datalen;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);  // publish to receivers
+}
 
-    // store message data
-    if (queue->in + datalen > queue->size) {  // check wrap-around for data
-        memcpy(queue_buffer + queue->in, bufptr, queue->size - queue->in);  // part before wrap
-        memcpy(queue_buffer, ((char*)bufptr) + (queue->size - queue->in), datalen - (queue->size - queue->in));  // part after wrap
-        queue->in = datalen - (queue->size - queue->in);
-    } else {
-        memcpy(queue_buffer + queue->in, bufptr, datalen);
-        queue->in = (queue->in + datalen) % queue->size;
+// claim up to n consecutive full slots at out with one compare-and-swap,
+// record k going to bufs[k] (no size limit if bufs is NULL); returns how
+// many (>= 1) with the first position in *posp, or -1 with errno EAGAIN
+// when the queue is empty and EMSGSIZE when the first record does not fit.
+static int mf_slots_claim_out_n(mf_queue_t *queue, const struct iovec *bufs, int n, unsigned int *posp) {
+    unsigned int pos = __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_RELAXED);
+    for (;;) {
+        mf_slot_t *slot = mf_slot_at(queue, pos);
+        int dif = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (dif == 0 && slot->len == MF_SLOT_SKIP) {
+            // a cancelled reservation: step over it and free the slot
+            if (__atomic_compare_exchange_n((unsigned int *)&queue->out, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                __atomic_store_n(&slot->seq, pos++ + queue->nslots, __ATOMIC_RELEASE);
+        } else if (dif == 0) {
+            if (bufs != NULL && slot->len > (int)bufs[0].iov_len) {
+                errno = EMSGSIZE;
+                return -1;  // caller's buffer is too small, leave the message queued
+            }
+            int k = 1;
+            while (k < n && k < queue->nslots) {
+                mf_slot_t *next = mf_slot_at(queue, pos + k);
+                if (__atomic_load_n(&next->seq, __ATOMIC_ACQUIRE) != pos + k + 1 || next->len == MF_SLOT_SKIP ||
+                    (bufs != NULL && next->len > (int)bufs[k].iov_len))
+                    break;
+                k++;
+            }
+            if (__atomic_compare_exchange_n((unsigned int *)&queue->out, &pos, pos + k, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                for (int i = 0; queue->stamp && i < k; i++)
+                    mf_lat_record(queue, mf_slot_at(queue, pos + i)->data);
+                *posp = pos;
+                return k;
+            }
+        } else if (dif < 0) {
+            errno = EAGAIN;
+            return -1;  // queue empty
+        } else {
+            pos = __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_RELAXED);
+        }
     }
+}
+
+// claim the oldest full slot; NULL with errno EAGAIN when the queue is
+// empty. the caller reads it and calls mf_slot_free.
+static mf_slot_t *mf_slots_claim_out(mf_queue_t *queue, int bufsize, unsigned int *posp) {
+    struct iovec buf = { NULL, bufsize };
+
+    if (mf_slots_claim_out_n(queue, &buf, 1, posp) < 0)
+        return NULL;
+    return mf_slot_at(queue, *posp);
+}
 
-    sem_post(semaphore_id); // release the global semaphore
+static void mf_slot_free(mf_queue_t *queue, mf_slot_t *slot, unsigned int pos) {
+    // free the slot for the sender one lap ahead
+    __atomic_store_n(&slot->seq, pos + queue->nslots, __ATOMIC_RELEASE);
+}
+
+static int mf_slots_send(mf_queue_t *queue, void *bufptr, int datalen) {
+    unsigned int pos;
+    mf_slot_t *slot = mf_slots_claim_in(queue, datalen, &pos);
+    if (slot == NULL)
+        return -1;
+    memcpy(mf_slot_data(queue, slot), bufptr, datalen);
+    mf_slot_publish(queue, slot, pos, datalen);
     return 0;
 }
-int mf_recv(int qid, void *bufptr, int bufsize) {
-    sem_wait(semaphore_id);  // Synchronize access
 
-    mf_queue_t *queue = (mf_queue_t *)((char *)global_shmem_addr + sizeof(shmem_metadata_t) + (qid - 1) * sizeof(mf_queue_t));
-    if (queue->out == queue->in) {
-        sem_post(semaphore_id);
-        return -1;  // Queue empty, nothing to receive
-    }
+static int mf_slots_recv(mf_queue_t *queue, void *bufptr, int bufsize) {
+    unsigned int pos;
+    mf_slot_t *slot = mf_slots_claim_out(queue, bufsize, &pos);
+    if (slot == NULL)
+        return -1;
+    int msg_len = slot->len;
+    memcpy(bufptr, mf_slot_data(queue, slot), msg_len);
+    mf_slot_free(queue, slot, pos);
+    return msg_len;
+}
 
-    // read the length of the next message
-    int msg_len;
-    char *queue_buffer = (char *)queue + sizeof(mf_queue_t);
-    if (queue->out + sizeof(int) > queue->size) {  // wrap-around case for length
-        int first_part = queue->size - queue->out;
-        memcpy(&msg_len, queue_buffer + queue->out, first_part);  // part before wrap
-        memcpy(((char*)&msg_len) + first_part, queue_buffer, sizeof(int) - first_part);  // part after wrap
-    } else {
-        memcpy(&msg_len, queue_buffer + queue->out, sizeof(int));
-    }
+// MF_MODE_FIXED keeps nslots records of slot_size bytes, one every
+// slot_stride (slot_size rounded up to 8) bytes. in and out count
+// records and only grow; record pos sits at (pos & (nslots - 1)) *
+// slot_stride, so none wraps around the end of the buffer and none
+// carries a length. As with MF_MODE_SPSC only the sender moves in and
+// only the receiver moves out.
+static inline char *mf_fixed_at(mf_queue_t *queue, unsigned int pos) {
+    return mf_at(queue->buffer_off) + (pos & (queue->nslots - 1)) * queue->slot_stride;
+}
 
-    int start_data = (queue->out + sizeof(int)) % queue->size;  // start of message data
-    if (start_data + msg_len > queue->size) {  // handle wrap-around
-        int first_part_size = queue->size - start_data;
-        memcpy(bufptr, queue_buffer + start_data, first_part_size);
-        memcpy((char *)bufptr + first_part_size, queue_buffer, msg_len - first_part_size);
-    } else {
-        memcpy(bufptr, queue_buffer + start_data, msg_len);
+// memcpy with a constant size for the usual record sizes, which the
+// compiler turns into a few moves
+static inline void mf_fixed_copy(void *dst, const void *src, int size) {
+    switch (size) {
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    case 16: memcpy(dst, src, 16); break;
+    case 24: memcpy(dst, src, 24); break;
+    case 32: memcpy(dst, src, 32); break;
+    case 64: memcpy(dst, src, 64); break;
+    case 128: memcpy(dst, src, 128); break;
+    default: memcpy(dst, src, size); break;
     }
+}
 
-    queue->out = (start_data + msg_len) % queue->size;  // move the out pointer past the message
+// put up to n records from iov into free slots; returns how many (>= 1)
+// or -1 with errno EAGAIN when the queue is full
+static int mf_fixed_put(mf_queue_t *queue, const struct iovec *iov, int n) {
+    unsigned int in = queue->in;
+    // acquire pairs with the receiver's release of out: the slots are free
+    unsigned int room = queue->nslots - (in - __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_ACQUIRE));
 
-    sem_post(semaphore_id);
-    return msg_len;  // return the length of the message received
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    n = min(n, (int)room);
+    for (int i = 0; i < n; i++)
+        mf_fixed_copy(mf_fixed_at(queue, in + i), iov[i].iov_base, queue->slot_size);
+    __atomic_store_n((unsigned int *)&queue->in, in + n, __ATOMIC_RELEASE);  // publish the records
+    return n;
 }
 
-int mf_print()
-{
+// take up to n records into bufs, setting each iov_len to slot_size;
+// returns how many (>= 1) or -1 with errno EAGAIN when the queue is
+// empty, EMSGSIZE when bufs[0] is too small
+static int mf_fixed_get(mf_queue_t *queue, struct iovec *bufs, int n) {
+    unsigned int out = queue->out;
+    unsigned int used = __atomic_load_n((unsigned int *)&queue->in, __ATOMIC_ACQUIRE) - out;
+    int i;
+
+    if (used == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    n = min(n, (int)used);
+    for (i = 0; i < n && (int)bufs[i].iov_len >= queue->slot_size; i++) {
+        mf_fixed_copy(bufs[i].iov_base, mf_fixed_at(queue, out + i), queue->slot_size);
+        bufs[i].iov_len = queue->slot_size;
+    }
+    if (i == 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    __atomic_store_n((unsigned int *)&queue->out, out + i, __ATOMIC_RELEASE);  // hand the slots back
+    return i;
+}
+
+// Priority lanes. Lane 0 of an MF_MODE_LOCKED queue is its own ring;
+// lanes 1.. are rings with a header of their own, all guarded by the
+// queue lock. lane_mask tells which higher lanes have messages, so a
+// receive of a queue without urgent traffic costs one more load, and
+// one with it finds the lane with a count of leading zeros. Counters,
+// futexes and readiness stay with the queue.
+static inline mf_queue_t *mf_lane(mf_queue_t *queue, int prio) {
+    return (mf_queue_t *)mf_at(queue->lane_off[prio]);
+}
+
+// header and buffer of one lane in segment seg; 0 if there is no room
+static int mf_lane_alloc(int seg, int size) {
+    int header_off = mf_buddy_alloc(seg, sizeof(mf_queue_t));
+    int buffer_off = header_off != 0 ? mf_buddy_alloc(seg, size) : 0;
+
+    if (buffer_off == 0) {
+        if (header_off != 0)
+            mf_buddy_free(header_off);
+        return 0;
+    }
+    ((mf_queue_t *)mf_at(header_off))->buffer_off = buffer_off;
+    ((mf_queue_t *)mf_at(header_off))->size = size;
+    return header_off;
+}
+
+static void mf_lanes_free(int *lane_off) {
+    for (int p = 1; p < MF_PRIO_LANES; p++) {
+        if (lane_off[p] == 0)
+            continue;
+        mf_buddy_free(((mf_queue_t *)mf_at(lane_off[p]))->buffer_off);
+        mf_buddy_free(lane_off[p]);
+        lane_off[p] = 0;
+    }
+}
+
+// the ring a receive takes from, under the lock: the highest lane with
+// messages, else the queue itself
+static inline mf_queue_t *mf_lane_pick(mf_queue_t *queue) {
+    unsigned int mask = queue->lane_mask;
+    return mask == 0 ? queue : mf_lane(queue, 31 - __builtin_clz(mask));
+}
+
+// a receive took from ring up to out
+static inline void mf_lane_taken(mf_queue_t *queue, mf_queue_t *ring, int out) {
+    ring->out = out;
+    if (ring != queue && out == ring->in)
+        queue->lane_mask &= ~(1u << ring->prio);
+}
+
+int mf_create(char *mqname, int mqsize) {
+    mf_qattr_t attr;
+
+    // a QUEUE entry in the config file decides the mode of a plain create
+    mf_qattr_init(&attr);
+    for (int i = 0; i < shmem_metadata->num_qconf; i++) {
+        if (strcmp(shmem_metadata->qconf[i].name, mqname) == 0) {
+            attr = shmem_metadata->qconf[i].attr;
+            break;
+        }
+    }
+    return mf_create_attr(mqname, mqsize, &attr);
+}
+
+int mf_create_mode(char *mqname, int mqsize, int mode) {
+    mf_qattr_t attr;
+
+    mf_qattr_init(&attr);
+    attr.mode = mode;
+    return mf_create_attr(mqname, mqsize, &attr);
+}
+
+int mf_create_fixed(char *mqname, int slot_size, int nslots) {
+    mf_qattr_t attr;
+
+    mf_qattr_init(&attr);
+    attr.mode = MF_MODE_FIXED;
+    attr.slot_size = slot_size;
+    attr.nslots = nslots > 0 ? nslots : -1;  // 0 would mean size it by mqsize
+    return mf_create_attr(mqname, 0, &attr);
+}
+
+int mf_create_attr(char *mqname, int mqsize, mf_qattr_t *attr) {
+    printf("mf create starts..\n");
+
+    if (attr->mode < MF_MODE_LOCKED || attr->mode > MF_MODE_FIXED) {
+        fprintf(stderr, "Unknown queue mode %d.\n", attr->mode);
+        errno = EINVAL;
+        return -1;
+    }
+    if ((attr->mode == MF_MODE_MPMC || attr->mode == MF_MODE_FIXED) &&
+        (attr->slot_size < MIN_DATALEN || attr->slot_size > MAX_DATALEN)) {
+        fprintf(stderr, "Slot size %d is out of bounds.\n", attr->slot_size);
+        errno = EINVAL;
+        return -1;
+    }
+    // a fixed queue is sized by its slots, rounded up to whole 4KB pages
+    int fixed_stride = (attr->slot_size + 7) & ~7, fixed_slots = attr->nslots;
+    if (attr->mode == MF_MODE_FIXED) {
+        if (fixed_slots == 0)
+            for (fixed_slots = 1; fixed_slots * 2 * fixed_stride <= mqsize * 1024; fixed_slots *= 2)
+                ;
+        if (fixed_slots < 2 || (fixed_slots & (fixed_slots - 1)) != 0 || fixed_slots > MAX_MQSIZE * 1024 / fixed_stride) {
+            fprintf(stderr, "%d slots of %d bytes are out of bounds or not a power of 2.\n", fixed_slots, attr->slot_size);
+            errno = EINVAL;
+            return -1;
+        }
+        mqsize = (fixed_slots * fixed_stride + 4095) / 4096 * 4;
+        if (mqsize < MIN_MQSIZE)
+            mqsize = MIN_MQSIZE;
+    }
+    if (attr->lanes < 1 || attr->lanes > MF_PRIO_LANES || (attr->lanes > 1 && attr->mode != MF_MODE_LOCKED)) {
+        fprintf(stderr, "%d priority lanes are out of bounds or need MODE=LOCKED.\n", attr->lanes);
+        errno = EINVAL;
+        return -1;
+    }
+    // a broadcast queue holds a message until every subscriber read it,
+    // there is no one count to limit
+    int max_msgs = attr->max_msgs >= 0 ? attr->max_msgs : attr->mode == MF_MODE_BCAST ? 0 : shmem_metadata->max_msgs;
+    int low_wm = attr->low_wm >= 0 ? attr->low_wm : attr->high_wm / 2;
+    if (max_msgs < 0 || attr->credits < 0 || (attr->credits > 1 && max_msgs == 0) || attr->high_wm < 0 ||
+        (max_msgs > 0 && attr->high_wm > max_msgs) || (attr->high_wm > 0 && low_wm >= attr->high_wm) ||
+        (attr->mode == MF_MODE_BCAST && (max_msgs > 0 || attr->high_wm > 0))) {
+        fprintf(stderr, "Message limit %d, credits %d or watermarks %d/%d are out of bounds.\n",
+                max_msgs, attr->credits, attr->high_wm, low_wm);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // acquire the global lock to ensure access to the shared memory
+    mf_global_lock();
+
+    // validation of mqsize (converted from KB to bytes for internal calculation)
+    int buffer_size = mqsize * 1024; // mqsize specified in KB, converted to bytes
+    if (mqsize < MIN_MQSIZE || mqsize > MAX_MQSIZE || buffer_size % 4096 != 0) {
+        fprintf(stderr, "Queue size %d KB is out of bounds or not a multiple of 4KB.\n", mqsize);
+        errno = EINVAL;
+        mf_global_unlock();
+        return -1;
+    }
+
+    unsigned int hash = mf_name_hash(mqname);
+    if (mf_dir_find(mqname, hash) >= 0) {
+        fprintf(stderr, "Queue %s already exists.\n", mqname);
+        errno = EEXIST;
+        mf_global_unlock();
+        return -1;
+    }
+
+    if (shmem_metadata->num_queues >= shmem_metadata->max_queues) {
+        fprintf(stderr, "MAX_QUEUES_IN_SHMEM (%d) queues exist already.\n", shmem_metadata->max_queues);
+        errno = ENOSPC;
+        mf_global_unlock();
+        return -1;
+    }
+
+    // find a free table slot, then blocks for the header and the buffer
+    int slot = shmem_metadata->next_slot, n = 0;
+    while (n < MF_MAX_QUEUES && shmem_metadata->queue_off[slot] != 0) {
+        slot = (slot + 1) % MF_MAX_QUEUES;
+        n++;
+    }
+    // all blocks of a queue come from one segment: the first with room,
+    // else a new one
+    int trace = (attr->trace >= 0 ? attr->trace : shmem_metadata->trace_latency) && attr->mode != MF_MODE_FIXED;  // no room for a stamp
+    int bcast = attr->mode == MF_MODE_BCAST;
+    int header_off = 0, buffer_off = 0, hist_off = 0, subs_off = 0;
+    int lane_off[MF_PRIO_LANES] = { 0 }, lane_size = buffer_size / 4 < 2 * MAX_DATALEN ? 2 * MAX_DATALEN : (buffer_size / 4) & ~4095, p;
+    for (int seg = 0; n < MF_MAX_QUEUES; seg++) {
+        if (seg == shmem_metadata->num_segs && mf_seg_grow() != seg)
+            break;
+        if (mf_seg_map(seg) == -1)
+            continue;
+        header_off = mf_buddy_alloc(seg, sizeof(mf_queue_t));
+        buffer_off = header_off != 0 ? mf_buddy_alloc(seg, buffer_size) : 0;
+        hist_off = buffer_off != 0 && trace ? mf_buddy_alloc(seg, sizeof(mf_lat_hist_t)) : 0;
+        subs_off = buffer_off != 0 && bcast ? mf_buddy_alloc(seg, MF_MAX_SUBS * sizeof(mf_cursor_t)) : 0;
+        int ok = buffer_off != 0 && (!trace || hist_off != 0) && (!bcast || subs_off != 0);
+        for (p = 1; p < attr->lanes && ok; p++)
+            ok = (lane_off[p] = mf_lane_alloc(seg, lane_size)) != 0;
+        if (ok)
+            break;
+        mf_lanes_free(lane_off);
+        if (subs_off != 0)
+            mf_buddy_free(subs_off);
+        if (hist_off != 0)
+            mf_buddy_free(hist_off);
+        if (buffer_off != 0)
+            mf_buddy_free(buffer_off);
+        if (header_off != 0)
+            mf_buddy_free(header_off);
+        header_off = buffer_off = 0;
+    }
+    if (buffer_off == 0) {
+        fprintf(stderr, "Not enough space in shared memory to create a new message queue.\n");
+        errno = ENOMEM;
+        mf_global_unlock();
+        return -1;
+    }
+
+    // setup  new queue in the allocated blocks
+    mf_queue_t *new_queue = (mf_queue_t *)mf_at(header_off);
+    strncpy(new_queue->name, mqname, MAX_MQNAMESIZE - 1);
+    new_queue->name[MAX_MQNAMESIZE - 1] = '\0';  // Ensure null termination
+    new_queue->size = buffer_size;
+    new_queue->buffer_off = buffer_off;
+    new_queue->mode = attr->mode;
+    new_queue->in = 0;
+    new_queue->out = 0;
+    new_queue->ref_count = 0;
+    new_queue->data_seq = 0;
+    new_queue->space_seq = 0;
+    new_queue->recv_waiters = 0;
+    new_queue->send_waiters = 0;
+    new_queue->notify = new_queue->ev_pending = 0;
+    new_queue->space_notify = new_queue->space_pending = 0;
+    new_queue->spin_count = attr->spin_count >= 0 ? attr->spin_count : shmem_metadata->wait_spin;
+    new_queue->yield_count = attr->yield_count >= 0 ? attr->yield_count : shmem_metadata->wait_yield;
+    new_queue->mirror = (attr->mirror >= 0 ? attr->mirror : shmem_metadata->mirror_rings) && attr->mode != MF_MODE_MPMC && attr->mode != MF_MODE_FIXED;
+    new_queue->slot = slot;
+    memset(&new_queue->wait_stats, 0, sizeof(new_queue->wait_stats));
+    memset(new_queue->stats, 0, sizeof(new_queue->stats));
+    new_queue->peak_bytes = 0;
+    new_queue->stamp = trace ? sizeof(unsigned long) : 0;
+    new_queue->hist_off = hist_off;
+    if (hist_off != 0)
+        memset(mf_qhist(new_queue), 0, sizeof(mf_lat_hist_t));
+    new_queue->subs_off = subs_off;
+    if (subs_off != 0)
+        memset(mf_at(subs_off), 0, MF_MAX_SUBS * sizeof(mf_cursor_t));
+    new_queue->max_msgs = max_msgs;
+    new_queue->credit_batch = attr->credits;
+    new_queue->high_wm = attr->high_wm;
+    new_queue->low_wm = low_wm;
+    new_queue->msgs = 0;
+    new_queue->credits = max_msgs;
+    new_queue->above_high = 0;
+    new_queue->lanes = attr->lanes;
+    new_queue->lane_mask = 0;
+    new_queue->prio = 0;
+    memcpy(new_queue->lane_off, lane_off, sizeof(lane_off));
+    for (p = 1; p < attr->lanes; p++) {
+        mf_queue_t *lane = mf_lane(new_queue, p);
+        snprintf(lane->name, MAX_MQNAMESIZE, "%.*s#%d", MAX_MQNAMESIZE - 8, mqname, p);
+        lane->mode = MF_MODE_LOCKED;
+        lane->in = lane->out = 0;
+        lane->mirror = 0;
+        lane->slot = slot;
+        lane->stamp = new_queue->stamp;
+        lane->hist_off = hist_off;  // latency goes into the queue's histogram
+        lane->subs_off = 0;
+        lane->lanes = 1;
+        lane->prio = p;
+    }
+    if (attr->mode == MF_MODE_MPMC)
+        mf_slots_init(new_queue, attr->slot_size);
+    if (attr->mode == MF_MODE_FIXED) {
+        new_queue->slot_size = attr->slot_size;
+        new_queue->slot_stride = fixed_stride;
+        new_queue->nslots = fixed_slots;
+    }
+    new_queue->reap_ns = 0;
+    if (mf_mutex_init(&new_queue->lock) == -1) {  // shared between processes
+        perror("Error initializing queue lock");
+        mf_lanes_free(lane_off);
+        if (subs_off != 0)
+            mf_buddy_free(subs_off);
+        if (hist_off != 0)
+            mf_buddy_free(hist_off);
+        mf_buddy_free(buffer_off);
+        mf_buddy_free(header_off);
+        mf_global_unlock();
+        return -1;
+    }
+
+    // publish the queue under a fresh generation and count it
+    mf_dir_begin();
+    shmem_metadata->queue_gen[slot] = (shmem_metadata->queue_gen[slot] + 1) & (INT_MAX >> MF_QID_SHIFT);
+    shmem_metadata->queue_off[slot] = header_off;
+    mf_dir_insert(hash, slot);
+    mf_dir_end();
+    shmem_metadata->next_slot = (slot + 1) % MF_MAX_QUEUES;
+    shmem_metadata->num_queues++;
+    printf("mf create: Queue created successfully. Total queues: %d\n", shmem_metadata->num_queues);
+
+    mf_global_unlock();
+    return 0;  // Success
+}
+
+int mf_remove(char *mqname) {
+    // Acquire the global lock
+    mf_global_lock();
+
+    // Find the queue to remove
+    int bucket = mf_dir_find(mqname, mf_name_hash(mqname));
+
+    // If the queue is not found, return an error
+    if (bucket < 0) {
+        errno = ENOENT;
+        mf_global_unlock();
+        return -1;
+    }
+    int slot = shmem_metadata->dir[bucket].slot - 1;
+    int header_off = shmem_metadata->queue_off[slot];
+    mf_queue_t *queue_to_remove = (mf_queue_t *)mf_at(header_off);  // mapped by mf_dir_find
+
+    // wait for a sender/receiver still inside the queue to leave
+    if (pthread_mutex_lock(&queue_to_remove->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&queue_to_remove->lock);  // it goes away anyway
+    pthread_mutex_unlock(&queue_to_remove->lock);
+    pthread_mutex_destroy(&queue_to_remove->lock);
+
+    // unpublish the queue, which also turns every qid for it stale, then
+    // give the blocks back; the other queues stay where they are
+    mf_dir_begin();
+    mf_dir_delete(bucket);
+    shmem_metadata->queue_off[slot] = 0;
+    mf_dir_end();
+    mf_buddy_free(queue_to_remove->buffer_off);
+    mf_lanes_free(queue_to_remove->lane_off);
+    if (queue_to_remove->hist_off != 0)
+        mf_buddy_free(queue_to_remove->hist_off);
+    if (queue_to_remove->subs_off != 0)
+        mf_buddy_free(queue_to_remove->subs_off);
+    mf_buddy_free(header_off);
+
+    // Decrement the number of queues
+    shmem_metadata->num_queues--;
+
+    // Release the global lock
+    mf_global_unlock();
+
+    return 0;
+}
+
+int mf_open(char *mqname) {
+    unsigned int hash = mf_name_hash(mqname);
+
+    // lock-free lookup: retry while a create/remove is changing the directory
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&shmem_metadata->dir_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        int bucket = mf_dir_find(mqname, hash);
+        int qid = bucket < 0 ? -1 : mf_make_qid(shmem_metadata->dir[bucket].slot - 1);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shmem_metadata->dir_seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (qid < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        mf_queue_t *queue = mf_queue_lookup(qid);
+        if (queue == NULL)
+            return -1;  // removed just now
+        __atomic_add_fetch(&queue->ref_count, 1, __ATOMIC_RELAXED);
+        return qid;  // the stable handle of the queue
+    }
+}
+
+int mf_close(int qid) {
+    // Check if the queue ID is valid
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+
+    if (queue->mode == MF_MODE_BCAST && mf_subs[queue->slot].qid == qid)
+        mf_unsubscribe(qid);
+    mf_msgs_return(queue);
+    __atomic_sub_fetch(&queue->ref_count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Payload pool. A blob is a buddy block handed out whole; its handle is
+// its region offset. Freed blobs do not go back to the buddy allocator
+// but onto a lock-free stack per order (a slab of blocks of that size),
+// so after warm-up alloc and free are one CAS each and never take the
+// global lock. The stack heads carry a tag bumped on every change
+// against ABA; a popped block's next may be read after another process
+// took it, which only makes the CAS fail. A blob in use is tagged
+// MF_BLOCK_BLOB in the order map and untagged on free, so handles of
+// queues or of freed blobs are refused.
+static inline int mf_blob_order(int size) {
+    int order = 0;
+    while (order < MF_BUDDY_ORDERS && (MF_BUDDY_MIN << order) < size)
+        order++;
+    return order;
+}
+
+// order of the largest block any segment, in use or still to be added,
+// can hold; fixed for the life of the region
+static int mf_blob_max_order() {
+    int top = mf_buddy_top_order(shmem_metadata->seg_size[0], 1);
+
+    if (shmem_metadata->max_segs > 1 && mf_buddy_top_order(shmem_metadata->seg_grow, 0) > top)
+        top = mf_buddy_top_order(shmem_metadata->seg_grow, 0);
+    return top;
+}
+
+// a new block of the given order from the buddy allocator, growing the
+// region if no segment has one; 0 if none can be had
+static int mf_blob_block(int order) {
+    int off = 0;
+
+    if (order > mf_blob_max_order())
+        return 0;  // no segment could hold it, do not grow for nothing
+    mf_global_lock();
+    for (int seg = 0; off == 0; seg++) {
+        if (seg == shmem_metadata->num_segs && mf_seg_grow() != seg)
+            break;
+        if (mf_seg_map(seg) == 0)
+            off = mf_buddy_alloc(seg, MF_BUDDY_MIN << order);
+    }
+    mf_global_unlock();
+    return off;
+}
+
+int mf_blob_alloc(int size, void **ptr) {
+    int order = mf_blob_order(size);
+    int off;
+
+    if (size < MIN_DATALEN || order >= MF_BUDDY_ORDERS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    unsigned long *top = &shmem_metadata->blob_free[order];
+    unsigned long head = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+    for (;;) {
+        off = (int)(head & 0xffffffffUL);
+        if (off == 0 || mf_seg_map(off >> MF_SEG_SHIFT) == -1) {
+            off = mf_blob_block(order);  // slab of this size is empty
+            break;
+        }
+        unsigned long next = ((head >> 32) + 1) << 32 | (unsigned int)((mf_free_block_t *)mf_at(off))->next;
+        if (__atomic_compare_exchange_n(top, &head, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (off == 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    __atomic_store_n(mf_buddy_unit(off), order | MF_BLOCK_BLOB, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shmem_metadata->blobs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shmem_metadata->blob_bytes, MF_BUDDY_MIN << order, __ATOMIC_RELAXED);
+    if (ptr != NULL)
+        *ptr = mf_at(off);
+    return off;
+}
+
+// order of the blob at handle, mapping its segment; -1 with errno EINVAL
+// for what is not a blob in use: queues, free or freed blocks
+static int mf_blob_check(int handle) {
+    int seg = handle >> MF_SEG_SHIFT, off = handle & MF_SEG_MASK;
+
+    if (handle <= 0 || seg >= __atomic_load_n(&shmem_metadata->num_segs, __ATOMIC_ACQUIRE) ||
+        off % MF_BUDDY_MIN != 0 || off >= shmem_metadata->seg_size[seg]) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mf_seg_map(seg) == -1)
+        return -1;
+    int unit = __atomic_load_n(mf_buddy_unit(handle), __ATOMIC_ACQUIRE);
+    if ((unit & (MF_BLOCK_FREE | MF_BLOCK_BLOB)) != MF_BLOCK_BLOB) {
+        errno = EINVAL;
+        return -1;
+    }
+    return unit & MF_BLOCK_ORDER;
+}
+
+void *mf_blob_ptr(int handle, int *size) {
+    int order = mf_blob_check(handle);
+    if (order < 0)
+        return NULL;
+    if (size != NULL)
+        *size = MF_BUDDY_MIN << order;
+    return mf_at(handle);
+}
+
+int mf_blob_free(int handle) {
+    int order = mf_blob_check(handle);
+    if (order < 0)
+        return -1;
+    // untag first, so of two frees of one blob only one gets through
+    unsigned char unit = order | MF_BLOCK_BLOB;
+    if (!__atomic_compare_exchange_n(mf_buddy_unit(handle), &unit, order, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned long *top = &shmem_metadata->blob_free[order];
+    unsigned long head = __atomic_load_n(top, __ATOMIC_RELAXED);
+    do {
+        ((mf_free_block_t *)mf_at(handle))->next = (int)(head & 0xffffffffUL);
+    } while (!__atomic_compare_exchange_n(top, &head, ((head >> 32) + 1) << 32 | (unsigned int)handle, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_sub_fetch(&shmem_metadata->blobs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&shmem_metadata->blob_bytes, MF_BUDDY_MIN << order, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// what mf_send_blob puts in the queue
+typedef struct {
+    int handle;
+    int len;
+} mf_blob_msg_t;
+
+int mf_send_blob(int qid, int handle, int datalen) {
+    mf_blob_msg_t msg = { handle, datalen };
+    int size;
+
+    if (mf_blob_ptr(handle, &size) == NULL)
+        return -1;
+    if (datalen < 0 || datalen > size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return mf_send(qid, &msg, sizeof(msg));
+}
+
+int mf_recv_blob(int qid, int *datalen) {
+    mf_blob_msg_t msg;
+
+    int n = mf_recv(qid, &msg, sizeof(msg));
+    if (n < 0)
+        return -1;
+    if (n != sizeof(msg)) {
+        errno = EBADMSG;  // not sent by mf_send_blob
+        return -1;
+    }
+    if (datalen != NULL)
+        *datalen = msg.len;
+    return msg.handle;
+}
+
+// copy n bytes into the ring at pos, splitting the copy at the end of the
+// buffer unless it is mirrored; returns the index just past the copied bytes
+static int mf_ring_put(mf_queue_t *queue, int pos, const void *src, int n) {
+    char *mirror = mf_qmirror(queue);
+    if (mirror != NULL) {
+        memcpy(mirror + pos, src, n);  // the second mapping takes the part past the end
+        return (pos + n) % queue->size;
+    }
+
+    int first = min(n, queue->size - pos);
+    memcpy(mf_qbuf(queue) + pos, src, first);
+    memcpy(mf_qbuf(queue), (const char *)src + first, n - first);  // part after wrap
+    return (pos + n) % queue->size;
+}
+
+// copy n bytes out of the ring at pos; returns the index past them
+static int mf_ring_get(mf_queue_t *queue, int pos, void *dst, int n) {
+    char *mirror = mf_qmirror(queue);
+    if (mirror != NULL) {
+        memcpy(dst, mirror + pos, n);
+        return (pos + n) % queue->size;
+    }
+
+    int first = min(n, queue->size - pos);
+    memcpy(dst, mf_qbuf(queue) + pos, first);
+    memcpy((char *)dst + first, mf_qbuf(queue), n - first);  // part after wrap
+    return (pos + n) % queue->size;
+}
+
+// Records in the byte ring are a 4-byte length prefix followed by the
+// payload (after the send timestamp on a traced queue), padded so every
+// record starts 4-byte aligned. A prefix thus never wraps, though a
+// timestamp or a copied payload may. MF_REC_WRAP in place of a
+// length means the rest of the buffer is unused and the next record is
+// at offset 0; zero-copy reservations use it to stay contiguous.
+#define MF_REC_WRAP -1
+
+static inline int mf_rec_size(mf_queue_t *queue, int len) {
+    return sizeof(int) + queue->stamp + ((len + 3) & ~3);
+}
+
+// ring index of the payload of the record at pos
+static inline int mf_rec_data(mf_queue_t *queue, int pos) {
+    return (pos + sizeof(int) + queue->stamp) % queue->size;
+}
+
+static inline int *mf_rec_len(mf_queue_t *queue, int pos) {
+    return (int *)(mf_qbuf(queue) + pos);
+}
+
+// append one length-prefixed record given a snapshot of in/out; returns
+// the new in index or -1 (errno EAGAIN) if the record does not fit
+static int mf_ring_send(mf_queue_t *queue, int in, int out, void *bufptr, int datalen) {
+    int total_size = mf_rec_size(queue, datalen);  // Total size to store length + data
+    int used = (in - out + queue->size) % queue->size;
+    if (total_size > queue->size - used - (int)sizeof(int)) {  // one unit kept free to tell full from empty
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *mf_rec_len(queue, in) = datalen;  // store the message length first
+    if (queue->stamp) {
+        unsigned long now = mf_now_ns();
+        mf_ring_put(queue, in + sizeof(int), &now, sizeof(now));
+    }
+    mf_ring_put(queue, mf_rec_data(queue, in), bufptr, datalen);
+    return (in + total_size) % queue->size;
+}
+
+// remove the record at out into bufptr; returns the new out index, or -1
+// with errno EAGAIN if the ring is empty and EMSGSIZE if the record is
+// larger than bufsize
+static int mf_ring_recv(mf_queue_t *queue, int in, int out, void *bufptr, int bufsize, int *msg_len) {
+    if (out == in) {
+        errno = EAGAIN;
+        return -1;  // Queue empty, nothing to receive
+    }
+
+    if (*mf_rec_len(queue, out) == MF_REC_WRAP)
+        out = 0;
+    *msg_len = *mf_rec_len(queue, out);
+    if (*msg_len > bufsize) {
+        errno = EMSGSIZE;
+        return -1;  // caller's buffer is too small, leave the message queued
+    }
+    if (queue->stamp) {
+        unsigned long sent;
+        mf_ring_get(queue, out + sizeof(int), &sent, sizeof(sent));
+        mf_lat_record(queue, &sent);
+    }
+    mf_ring_get(queue, mf_rec_data(queue, out), bufptr, *msg_len);
+    return (out + mf_rec_size(queue, *msg_len)) % queue->size;
+}
+
+// find room for a contiguous record of datalen given a snapshot of
+// in/out; returns the offset of its length prefix or -1 (errno EAGAIN).
+// if the payload would run past the end of an unmirrored buffer, a wrap
+// marker is left at in and the record goes to offset 0.
+static int mf_ring_reserve(mf_queue_t *queue, int in, int out, int datalen) {
+    int total_size = mf_rec_size(queue, datalen);
+    int used = (in - out + queue->size) % queue->size;
+    int pos = in;
+
+    if (mf_qmirror(queue) == NULL && (int)sizeof(int) + queue->stamp + datalen > queue->size - in) {
+        total_size += queue->size - in;  // the skipped tail counts as used
+        pos = 0;
+    }
+    if (total_size > queue->size - used - (int)sizeof(int)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (pos != in)
+        *mf_rec_len(queue, in) = MF_REC_WRAP;
+    return pos;
+}
+
+// Blocking is built on two futex words per queue. data_seq is bumped
+// after a send and space_seq after a receive, but only while somebody is
+// parked on them (recv_waiters/send_waiters), so the fast path of an
+// uncontended queue never enters the kernel. The futexes are not
+// FUTEX_PRIVATE: waiters and wakers are different processes.
+static void mf_wake(int *seq, int *waiters, int nwake) {
+    // pairs with the waiter's registration: either we see the waiter, or
+    // the waiter's re-check sees what we just published
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, seq, FUTEX_WAKE, nwake, NULL, NULL, 0);
+}
+
+// time left until deadline into rel; -1 with errno ETIMEDOUT once it passed
+static int mf_time_left(const struct timespec *deadline, struct timespec *rel) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel->tv_sec = deadline->tv_sec - now.tv_sec;
+    rel->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (rel->tv_nsec < 0) {
+        rel->tv_sec--;
+        rel->tv_nsec += 1000000000L;
+    }
+    if (rel->tv_sec < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+// sleep on seq while it still holds 'expected'; the caller registered in
+// *waiters and re-checked the queue after reading expected. returns -1
+// with errno ETIMEDOUT once the deadline passed, 0 otherwise.
+static int mf_park(int *seq, int expected, const struct timespec *deadline) {
+    struct timespec rel, *timeout = NULL;
+
+    if (deadline != NULL) {
+        if (mf_time_left(deadline, &rel) != 0)
+            return -1;
+        timeout = &rel;
+    }
+    if (syscall(SYS_futex, seq, FUTEX_WAIT, expected, timeout, NULL, 0) == -1 && errno == ETIMEDOUT)
+        return -1;
+    return 0;
+}
+
+static inline void mf_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Live counters. Each process adds to its own cache-line slot of
+// queue->stats (relaxed atomics, as two processes can share a slot) and
+// mf_get_stats sums the slots, so counting on the hot path never moves a
+// line between the sender and the receiver.
+static inline mf_stat_slot_t *mf_qstat(mf_queue_t *queue) {
+    return &queue->stats[mf_stat_slot];
+}
+
+static void mf_count_enq(mf_queue_t *queue, int msgs, unsigned long bytes) {
+    mf_stat_slot_t *st = mf_qstat(queue);
+    __atomic_add_fetch(&st->enq_msgs, msgs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->enq_bytes, bytes, __ATOMIC_RELAXED);
+
+    // high-water mark from a racy look at in/out; the shared word is
+    // written only when the mark rises
+    unsigned int in = __atomic_load_n((unsigned int *)&queue->in, __ATOMIC_RELAXED);
+    unsigned int out = __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_RELAXED);
+    int used = queue->mode == MF_MODE_MPMC || queue->mode == MF_MODE_FIXED ? (int)(in - out) * queue->slot_stride
+                                           : ((int)in - (int)out + queue->size) % queue->size;
+    int peak = __atomic_load_n(&queue->peak_bytes, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&queue->peak_bytes, &peak, used, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void mf_count_deq(mf_queue_t *queue, int msgs, unsigned long bytes) {
+    mf_stat_slot_t *st = mf_qstat(queue);
+    __atomic_add_fetch(&st->deq_msgs, msgs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->deq_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Message limits. A queue with a limit or watermarks counts its
+// messages in msgs, next to credits on a line of their own; other
+// queues skip all of this. Without a credit pool a sender claims its
+// messages in msgs before it writes them, so msgs never exceeds
+// max_msgs. With one, senders take credit_batch credits from the pool
+// at once into mf_held and count msgs only when a message is sent;
+// receivers put one credit back per message.
+static inline int mf_msgs_counted(mf_queue_t *queue) {
+    return queue->max_msgs > 0 || queue->high_wm > 0;
+}
+
+static inline int mf_msgs_pooled(mf_queue_t *queue) {
+    return queue->max_msgs > 0 && queue->credit_batch > 1;
+}
+
+// messages in a counted queue; a receive may be counted before the
+// send it took
+static inline int mf_msgs_now(mf_queue_t *queue) {
+    int count = __atomic_load_n(&queue->msgs, __ATOMIC_RELAXED);
+    return count > 0 ? count : 0;
+}
+
+// raise the high watermark at count messages, or lower it
+static void mf_msgs_mark(mf_queue_t *queue, int count) {
+    int high;
+
+    if (queue->high_wm == 0)
+        return;
+    if (count >= queue->high_wm && !__atomic_load_n(&queue->above_high, __ATOMIC_RELAXED))
+        high = 1;
+    else if (count <= queue->low_wm && __atomic_load_n(&queue->above_high, __ATOMIC_RELAXED))
+        high = 0;
+    else
+        return;
+    if (__atomic_exchange_n(&queue->above_high, high, __ATOMIC_RELAXED) == high)
+        return;  // another process got there first
+    int qid = mf_make_qid(queue->slot);
+    if (mf_wm[queue->slot].qid == qid && mf_wm[queue->slot].fn != NULL)
+        mf_wm[queue->slot].fn(qid, high, mf_wm[queue->slot].arg);
+}
+
+static inline unsigned long mf_held_word(int qid, int n) {
+    return (unsigned long)(unsigned int)qid << 32 | (unsigned int)n;
+}
+
+// credits in a mf_held word, 0 if they belong to an older queue
+static inline int mf_held_count(unsigned long word, int qid) {
+    return (int)(word >> 32) == qid ? (int)(word & 0xffffffffUL) : 0;
+}
+
+// keep n more credits for queue
+static void mf_held_add(mf_queue_t *queue, int n) {
+    int qid = mf_make_qid(queue->slot);
+    unsigned long *held = &mf_held[queue->slot];
+    unsigned long word = __atomic_load_n(held, __ATOMIC_RELAXED);
+
+    if (n <= 0)
+        return;
+    while (!__atomic_compare_exchange_n(held, &word, mf_held_word(qid, mf_held_count(word, qid) + n), 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// claim room for up to n messages before a send; returns how many
+// (>= 1) or -1 with errno EAGAIN when the queue holds max_msgs
+static int mf_msgs_take(mf_queue_t *queue, int n) {
+    if (queue->max_msgs == 0)
+        return n;
+    if (!mf_msgs_pooled(queue)) {
+        int room = queue->max_msgs - __atomic_fetch_add(&queue->msgs, n, __ATOMIC_RELAXED);
+        if (room < n)
+            __atomic_sub_fetch(&queue->msgs, room > 0 ? n - room : n, __ATOMIC_RELAXED);
+        if (room <= 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        n = min(n, room);
+        mf_msgs_mark(queue, queue->max_msgs - room + n);
+        return n;
+    }
+
+    int qid = mf_make_qid(queue->slot);
+    unsigned long *held = &mf_held[queue->slot];
+    unsigned long word = __atomic_load_n(held, __ATOMIC_RELAXED);
+    int have, take;
+    while ((have = mf_held_count(word, qid)) > 0) {
+        take = min(n, have);
+        if (__atomic_compare_exchange_n(held, &word, mf_held_word(qid, have - take), 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return take;
+    }
+
+    // none held: take a batch from the pool, keep what this send leaves
+    int avail = __atomic_load_n(&queue->credits, __ATOMIC_RELAXED);
+    do {
+        if (avail <= 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        take = min(avail, queue->credit_batch);
+    } while (!__atomic_compare_exchange_n(&queue->credits, &avail, avail - take, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    n = min(n, take);
+    mf_held_add(queue, take - n);
+    return n;
+}
+
+// give back room for n messages mf_msgs_take claimed but were not sent
+static void mf_msgs_untake(mf_queue_t *queue, int n) {
+    if (queue->max_msgs == 0)
+        return;
+    if (mf_msgs_pooled(queue))
+        mf_held_add(queue, n);
+    else
+        __atomic_sub_fetch(&queue->msgs, n, __ATOMIC_RELAXED);
+}
+
+// n messages went into the queue
+static void mf_msgs_sent(mf_queue_t *queue, int n) {
+    if (!mf_msgs_counted(queue) || (queue->max_msgs > 0 && !mf_msgs_pooled(queue)))
+        return;  // not counted, or counted by mf_msgs_take
+    mf_msgs_mark(queue, __atomic_add_fetch(&queue->msgs, n, __ATOMIC_RELAXED));
+}
+
+// n messages left the queue
+static void mf_msgs_received(mf_queue_t *queue, int n) {
+    if (!mf_msgs_counted(queue))
+        return;
+    int count = __atomic_sub_fetch(&queue->msgs, n, __ATOMIC_RELAXED);
+    if (mf_msgs_pooled(queue))
+        __atomic_add_fetch(&queue->credits, n, __ATOMIC_RELAXED);
+    mf_msgs_mark(queue, count);
+}
+
+// put the credits this process holds for queue back into its pool
+static void mf_msgs_return(mf_queue_t *queue) {
+    int n = mf_held_count(__atomic_exchange_n(&mf_held[queue->slot], 0, __ATOMIC_RELAXED), mf_make_qid(queue->slot));
+    if (n > 0) {
+        __atomic_add_fetch(&queue->credits, n, __ATOMIC_RELAXED);
+        mf_space_ready(queue);
+    }
+}
+
+static void mf_msgs_return_all() {
+    for (int i = 0; i < MF_MAX_QUEUES; i++) {
+        unsigned long word = __atomic_load_n(&mf_held[i], __ATOMIC_RELAXED);
+        mf_queue_t *queue = word != 0 ? mf_queue_lookup((int)(word >> 32)) : NULL;
+        if (queue != NULL)
+            mf_msgs_return(queue);
+        __atomic_store_n(&mf_held[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// a ring index a live owner could have left
+static inline int mf_index_ok(mf_queue_t *ring, int i) {
+    return i >= 0 && i < ring->size && i % 4 == 0;
+}
+
+// the owner of the queue lock died. in and out are single stores made
+// after the record is complete, so a half-written send or half-read
+// receive is simply not there; what can be left behind is a lane bit
+// not yet set or cleared, which is recomputed. The cached broadcast gate
+// only ever lags, which is safe.
+static void mf_queue_recover(mf_queue_t *queue) {
+    for (int p = 0; p < queue->lanes; p++) {
+        mf_queue_t *ring = p == 0 ? queue : mf_lane(queue, p);
+        if (!mf_index_ok(ring, ring->in) || !mf_index_ok(ring, ring->out))
+            ring->in = ring->out = 0;  // cannot happen short of a stray write: drop the contents
+        if (p > 0 && ring->in != ring->out)
+            queue->lane_mask |= 1u << p;
+        else if (p > 0)
+            queue->lane_mask &= ~(1u << p);
+    }
+    pthread_mutex_consistent(&queue->lock);
+    __atomic_add_fetch(&mf_qstat(queue)->recoveries, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "mf: took over the lock of queue %s from a dead process\n", queue->name);
+}
+
+// take the queue lock of an MF_MODE_LOCKED queue; only a contended
+// acquisition is timed, so the uncontended path reads no clock
+static void mf_queue_lock(mf_queue_t *queue) {
+    struct timespec t0, t1;
+
+    int rc = pthread_mutex_trylock(&queue->lock);
+    if (rc == EBUSY) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        rc = pthread_mutex_lock(&queue->lock);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        mf_stat_slot_t *st = mf_qstat(queue);
+        __atomic_add_fetch(&st->lock_waits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->lock_wait_ns, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec),
+                           __ATOMIC_RELAXED);
+    }
+    if (rc == EOWNERDEAD)
+        mf_queue_recover(queue);
+}
+
+// the lock is a mutex: the thread that took it (in mf_send_reserve,
+// mf_recv_peek) gives it back
+static inline void mf_queue_unlock(mf_queue_t *queue) {
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Broadcast queues (MF_MODE_BCAST) are byte rings with a read cursor
+// per subscriber in the block at subs_off. Senders append under the
+// queue lock and copy a message once however many subscribers there
+// are; every subscriber reads lock-free through its own cursor, like the
+// receiver of an SPSC queue. Senders keep the slowest cursor they last
+// saw in out and scan the cursors again only when a record does not fit
+// behind it.
+static inline mf_cursor_t *mf_qcursors(mf_queue_t *queue) {
+    return (mf_cursor_t *)mf_at(queue->subs_off);
+}
+
+// where this process reads the queue: out, or its broadcast cursor
+static inline int *mf_qout(mf_queue_t *queue) {
+    if (queue->mode != MF_MODE_BCAST)
+        return &queue->out;
+    return &mf_qcursors(queue)[mf_subs[queue->slot].cursor].pos;
+}
+
+// -1 with errno ENOTCONN if this process may not receive from queue
+static int mf_check_reader(mf_queue_t *queue, int qid) {
+    if (queue->mode == MF_MODE_BCAST && mf_subs[queue->slot].qid != qid) {
+        errno = ENOTCONN;  // mf_subscribe first
+        return -1;
+    }
+    return 0;
+}
+
+// position of the subscriber furthest behind in, or in if there is none
+static int mf_bcast_gate(mf_queue_t *queue, int in) {
+    mf_cursor_t *cursors = mf_qcursors(queue);
+    int lag = 0;
+
+    for (int i = 0; i < MF_MAX_SUBS; i++) {
+        if (__atomic_load_n(&cursors[i].pid, __ATOMIC_ACQUIRE) == 0)
+            continue;
+        // acquire pairs with the subscriber's release: its bytes are read
+        int pos = __atomic_load_n(&cursors[i].pos, __ATOMIC_ACQUIRE);
+        int behind = (in - pos + queue->size) % queue->size;
+        if (behind > lag)
+            lag = behind;
+    }
+    return (in - lag + queue->size) % queue->size;
+}
+
+#define MF_REAP_NS 10000000L  // look for dead subscribers at most every 10 ms
+
+// drop the cursors of subscribers that died without unsubscribing, which
+// would hold back every sender for good; called by a sender under the
+// queue lock when the queue is full. Returns how many were dropped.
+static int mf_bcast_reap(mf_queue_t *queue) {
+    mf_cursor_t *cursors = mf_qcursors(queue);
+    long now = mf_now_ns();
+    int n = 0;
+
+    if (now - queue->reap_ns < MF_REAP_NS)
+        return 0;
+    queue->reap_ns = now;
+    for (int i = 0; i < MF_MAX_SUBS; i++) {
+        int pid = __atomic_load_n(&cursors[i].pid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH &&
+            __atomic_compare_exchange_n(&cursors[i].pid, &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            n++;
+    }
+    if (n > 0) {
+        __atomic_add_fetch(&mf_qstat(queue)->recoveries, n, __ATOMIC_RELAXED);
+        fprintf(stderr, "mf: dropped %d dead subscriber(s) of queue %s\n", n, queue->name);
+    }
+    return n;
+}
+
+// mf_ring_send for a sender holding the queue lock; on a broadcast queue
+// a record that does not fit behind the cached gate gets a second try
+// behind a fresh one
+static int mf_ring_send_locked(mf_queue_t *queue, int in, void *bufptr, int datalen) {
+    int next = mf_ring_send(queue, in, queue->out, bufptr, datalen);
+    if (next < 0 && queue->mode == MF_MODE_BCAST) {
+        queue->out = mf_bcast_gate(queue, in);
+        next = mf_ring_send(queue, in, queue->out, bufptr, datalen);
+        if (next < 0 && mf_bcast_reap(queue) > 0) {
+            queue->out = mf_bcast_gate(queue, in);
+            next = mf_ring_send(queue, in, queue->out, bufptr, datalen);
+        }
+    }
+    return next;
+}
+
+int mf_subscribe(int qid) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->mode != MF_MODE_BCAST) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mf_subs[queue->slot].qid == qid)
+        return 0;  // already subscribed
+
+    // under the queue lock no sender moves in or scans the cursors, so
+    // the new cursor starts at the next record sent
+    mf_cursor_t *cursors = mf_qcursors(queue);
+    mf_queue_lock(queue);
+    for (int i = 0; i < MF_MAX_SUBS; i++) {
+        if (cursors[i].pid != 0)
+            continue;
+        cursors[i].pos = queue->in;
+        __atomic_store_n(&cursors[i].pid, getpid(), __ATOMIC_RELEASE);
+        mf_queue_unlock(queue);
+        mf_subs[queue->slot].qid = qid;
+        mf_subs[queue->slot].cursor = i;
+        return 0;
+    }
+    mf_queue_unlock(queue);
+    errno = EUSERS;  // MF_MAX_SUBS reached
+    return -1;
+}
+
+int mf_unsubscribe(int qid) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->mode != MF_MODE_BCAST || mf_subs[queue->slot].qid != qid) {
+        errno = EINVAL;  // not subscribed
+        return -1;
+    }
+
+    __atomic_store_n(&mf_qcursors(queue)[mf_subs[queue->slot].cursor].pid, 0, __ATOMIC_RELEASE);
+    mf_subs[queue->slot].qid = 0;
+    // the cursor may have held back a blocked sender
+    mf_space_ready(queue);
+    return 0;
+}
+
+// Readiness fds. mfserver keeps two eventfds per queue, one per kind,
+// and passes them to every process that asks: mf_get_fd/mf_get_space_fd
+// callers, and the senders/receivers that raise them. Once notify is
+// set, the sender (MF_EV_DATA) or receiver (MF_EV_SPACE) that finds
+// pending clear sets it and writes the eventfd; a watcher whose receive
+// finds the queue empty (send: full) reads the eventfd back to zero,
+// clears pending and tries again. So an eventfd is written once per
+// turn, and queues nobody watches pay one load per operation.
+
+static int *mf_ev_notify(mf_queue_t *queue, int kind) {
+    return kind == MF_EV_SPACE ? &queue->space_notify : &queue->notify;
+}
+
+static int *mf_ev_pending(mf_queue_t *queue, int kind) {
+    return kind == MF_EV_SPACE ? &queue->space_pending : &queue->ev_pending;
+}
+
+// mfserver: the eventfd of queue, made on first use
+static int mf_server_evfd(mf_queue_t *queue, int qid, int kind) {
+    int slot = queue->slot;
+
+    if (mf_evfds[kind][slot].qid != qid) {
+        if (mf_evfds[kind][slot].qid != 0 && mf_evfds[kind][slot].fd >= 0)
+            close(mf_evfds[kind][slot].fd);  // of a removed queue
+        mf_evfds[kind][slot].qid = qid;
+        mf_evfds[kind][slot].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return mf_evfds[kind][slot].fd;
+}
+
+// ask mfserver for an eventfd of qid; -1 with errno on failure. The
+// request is the qid, followed by the kind unless it is MF_EV_DATA.
+static int mf_fetch_evfd(int qid, int kind) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = mf_sock_addr(&addr);
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int req[2] = { qid, kind };
+    int req_len = kind == MF_EV_DATA ? sizeof(int) : sizeof(req);
+    int status = ENOTCONN, fd = -1;
+    struct iovec iov = { &status, sizeof(status) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, addr_len) == 0 &&
+        send(sock, req, req_len, 0) == req_len &&
+        recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == sizeof(status) && status == 0) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    } else if (status != 0) {
+        errno = status;  // from mfserver, or ENOTCONN
+    }
+    close(sock);
+    return fd;
+}
+
+// this process' copy of an eventfd of queue, fetched once; a failed
+// fetch is remembered too, so senders do not ask on every message
+static int mf_queue_evfd(mf_queue_t *queue, int kind) {
+    int slot = queue->slot, qid = mf_make_qid(slot);
+
+    if (mf_evfds[kind][slot].qid == qid)
+        return mf_evfds[kind][slot].fd;
+    if (mf_listen_fd >= 0)
+        return mf_server_evfd(queue, qid, kind);
+    if (mf_evfds[kind][slot].qid != 0 && mf_evfds[kind][slot].fd >= 0)
+        close(mf_evfds[kind][slot].fd);
+    mf_evfds[kind][slot].qid = qid;
+    mf_evfds[kind][slot].fd = mf_fetch_evfd(qid, kind);
+    return mf_evfds[kind][slot].fd;
+}
+
+// whether a receive would find a message, without taking it
+static int mf_queue_ready(mf_queue_t *queue) {
+    if (queue->mode == MF_MODE_MPMC) {
+        // look past tombstones of cancelled sends (mf_send_cancel)
+        unsigned int out = __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_RELAXED);
+        for (int n = 0; n < queue->nslots; n++, out++) {
+            mf_slot_t *slot = mf_slot_at(queue, out);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != out + 1)
+                return 0;
+            if (slot->len != MF_SLOT_SKIP)
+                return 1;
+        }
+        return 0;
+    }
+    return __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE) != __atomic_load_n(mf_qout(queue), __ATOMIC_RELAXED) ||
+           __atomic_load_n(&queue->lane_mask, __ATOMIC_RELAXED) != 0;
+}
+
+static void mf_notify(mf_queue_t *queue, int kind) {
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(mf_ev_pending(queue, kind), 1, __ATOMIC_SEQ_CST) != 0)
+        return;  // raised already
+    int fd = mf_queue_evfd(queue, kind);
+    if (fd >= 0 && write(fd, &one, sizeof(one)) == -1)
+        return;  // EAGAIN only at a counter of 2^64 - 2
+}
+
+// a receive found the queue empty (send: full): take a raised eventfd
+// down if this process holds it, so the next send (receive) raises it
+// again; returns 1 if the caller should try once more
+static int mf_rearm(mf_queue_t *queue, int kind) {
+    int slot = queue->slot;
+    uint64_t count;
+
+    if (!__atomic_load_n(mf_ev_pending(queue, kind), __ATOMIC_RELAXED))
+        return 0;
+    if (mf_evfds[kind][slot].qid != mf_make_qid(slot) || mf_evfds[kind][slot].fd < 0)
+        return 0;  // not watching
+    if (read(mf_evfds[kind][slot].fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        return 0;
+    __atomic_store_n(mf_ev_pending(queue, kind), 0, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+// a send published messages: wake parked receivers and raise the eventfd
+static void mf_data_ready(mf_queue_t *queue, int nwake) {
+    mf_wake(&queue->data_seq, &queue->recv_waiters, nwake);  // also orders notify after the send
+    if (__atomic_load_n(&queue->notify, __ATOMIC_RELAXED))
+        mf_notify(queue, MF_EV_DATA);
+}
+
+// a receive freed room: wake every parked sender, the room may fit any
+// of them, and raise the space eventfd
+static void mf_space_ready(mf_queue_t *queue) {
+    mf_wake(&queue->space_seq, &queue->send_waiters, INT_MAX);
+    if (__atomic_load_n(&queue->space_notify, __ATOMIC_RELAXED))
+        mf_notify(queue, MF_EV_SPACE);
+}
+
+// one non-blocking send attempt; -1 with errno EAGAIN when the queue is full
+static int mf_queue_send(mf_queue_t *queue, void *bufptr, int datalen) {
+    int in;
+
+    if (mf_msgs_take(queue, 1) < 0)
+        return -1;  // max_msgs in the queue
+    if (queue->mode == MF_MODE_MPMC) {
+        in = mf_slots_send(queue, bufptr, datalen);
+    } else if (queue->mode == MF_MODE_FIXED) {
+        struct iovec iov = { bufptr, datalen };
+        in = mf_fixed_put(queue, &iov, 1);
+    } else if (queue->mode == MF_MODE_SPSC) {
+        // only this process writes in; acquire pairs with the receiver's
+        // release of out so the freed bytes are really free
+        int out = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+        in = mf_ring_send(queue, queue->in, out, bufptr, datalen);
+        if (in >= 0)
+            __atomic_store_n(&queue->in, in, __ATOMIC_RELEASE);  // publish the record
+    } else {
+        mf_queue_lock(queue); // Lock only this queue
+        in = mf_ring_send_locked(queue, queue->in, bufptr, datalen);
+        if (in >= 0)
+            queue->in = in;
+        mf_queue_unlock(queue); // release the queue
+    }
+    if (in < 0) {
+        mf_msgs_untake(queue, 1);
+        return -1; // Not enough space
+    }
+    mf_msgs_sent(queue, 1);
+    mf_count_enq(queue, 1, datalen);
+    mf_data_ready(queue, queue->mode == MF_MODE_BCAST ? INT_MAX : 1);
+    return 0;
+}
+
+// one non-blocking receive attempt; -1 with errno EAGAIN when empty
+static int mf_queue_recv(mf_queue_t *queue, void *bufptr, int bufsize) {
+    int msg_len, out;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        msg_len = mf_slots_recv(queue, bufptr, bufsize);
+        if (msg_len < 0)
+            return -1;
+    } else if (queue->mode == MF_MODE_FIXED) {
+        struct iovec iov = { bufptr, bufsize };
+        if (mf_fixed_get(queue, &iov, 1) < 0)
+            return -1;
+        msg_len = queue->slot_size;
+    } else if (queue->mode != MF_MODE_LOCKED) {  // SPSC, or a broadcast subscriber
+        int *outp = mf_qout(queue);
+        int in = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+        out = mf_ring_recv(queue, in, *outp, bufptr, bufsize, &msg_len);
+        if (out < 0)
+            return -1;
+        __atomic_store_n(outp, out, __ATOMIC_RELEASE);  // hand the bytes back
+    } else {
+        mf_queue_lock(queue);  // Synchronize access to this queue only
+        mf_queue_t *ring = mf_lane_pick(queue);
+        out = mf_ring_recv(ring, ring->in, ring->out, bufptr, bufsize, &msg_len);
+        if (out >= 0)
+            mf_lane_taken(queue, ring, out);  // move the out pointer past the message
+        mf_queue_unlock(queue);
+        if (out < 0)
+            return -1;
+    }
+    mf_msgs_received(queue, 1);
+    mf_count_deq(queue, 1, msg_len);
+    // every parked sender re-checks: the freed space may fit any of them
+    mf_space_ready(queue);
+    return msg_len;  // return the length of the message received
+}
+
+// one non-blocking attempt to send as many of the n records in iov as
+// fit; returns how many (>= 1) or -1 with errno EAGAIN when none fits
+static int mf_queue_sendv(mf_queue_t *queue, void *arg, int n) {
+    const struct iovec *iov = arg;
+    unsigned int pos;
+    int i, in, out = 0, taken;
+
+    n = taken = mf_msgs_take(queue, n);
+    if (taken < 0)
+        return -1;  // max_msgs in the queue
+    if (queue->mode == MF_MODE_MPMC) {
+        n = mf_slots_claim_in_n(queue, n, &pos);
+        if (n < 0) {
+            mf_msgs_untake(queue, taken);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            mf_slot_t *slot = mf_slot_at(queue, pos + i);
+            memcpy(mf_slot_data(queue, slot), iov[i].iov_base, iov[i].iov_len);
+            mf_slot_publish(queue, slot, pos + i, iov[i].iov_len);
+        }
+    } else if (queue->mode == MF_MODE_FIXED) {
+        n = mf_fixed_put(queue, iov, n);
+        if (n < 0) {
+            mf_msgs_untake(queue, taken);
+            return -1;
+        }
+    } else {
+        if (queue->mode == MF_MODE_SPSC)
+            out = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+        else
+            mf_queue_lock(queue);  // once for the whole batch
+        in = queue->in;
+        for (i = 0; i < n; i++) {
+            int next = queue->mode == MF_MODE_SPSC ? mf_ring_send(queue, in, out, iov[i].iov_base, iov[i].iov_len)
+                                                   : mf_ring_send_locked(queue, in, iov[i].iov_base, iov[i].iov_len);
+            if (next < 0)
+                break;
+            in = next;
+        }
+        if (queue->mode == MF_MODE_SPSC) {
+            __atomic_store_n(&queue->in, in, __ATOMIC_RELEASE);  // publish all records
+        } else {
+            queue->in = in;
+            mf_queue_unlock(queue);
+        }
+        if (i == 0) {
+            mf_msgs_untake(queue, taken);
+            return -1;  // errno EAGAIN from mf_ring_send
+        }
+        n = i;
+    }
+    mf_msgs_untake(queue, taken - n);
+    mf_msgs_sent(queue, n);
+    unsigned long bytes = 0;
+    for (i = 0; i < n; i++)
+        bytes += iov[i].iov_len;
+    mf_count_enq(queue, n, bytes);
+    mf_data_ready(queue, queue->mode == MF_MODE_BCAST ? INT_MAX : n);
+    return n;
+}
+
+// receive into bufs from the priority lanes, highest first, under the
+// queue lock; returns how many
+static int mf_lanes_recv(mf_queue_t *queue, struct iovec *bufs, int n) {
+    int i = 0;
+
+    while (i < n && queue->lane_mask != 0) {
+        mf_queue_t *ring = mf_lane_pick(queue);
+        int msg_len, out = mf_ring_recv(ring, ring->in, ring->out, bufs[i].iov_base, bufs[i].iov_len, &msg_len);
+        if (out < 0)
+            break;  // errno EMSGSIZE
+        bufs[i++].iov_len = msg_len;
+        mf_lane_taken(queue, ring, out);
+    }
+    return i;
+}
+
+// one non-blocking attempt to receive up to n records into bufs, setting
+// each iov_len to the message length; returns how many (>= 1) or -1 with
+// errno EAGAIN when the queue is empty
+static int mf_queue_recv_batch(mf_queue_t *queue, void *arg, int n) {
+    struct iovec *bufs = arg;
+    unsigned int pos;
+    int i, in, out;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        n = mf_slots_claim_out_n(queue, bufs, n, &pos);
+        if (n < 0)
+            return -1;
+        for (i = 0; i < n; i++) {
+            mf_slot_t *slot = mf_slot_at(queue, pos + i);
+            bufs[i].iov_len = slot->len;
+            memcpy(bufs[i].iov_base, mf_slot_data(queue, slot), slot->len);
+            mf_slot_free(queue, slot, pos + i);
+        }
+    } else if (queue->mode == MF_MODE_FIXED) {
+        n = mf_fixed_get(queue, bufs, n);
+        if (n < 0)
+            return -1;
+    } else {
+        int *outp = mf_qout(queue);
+        int first = 0;
+        if (queue->mode != MF_MODE_LOCKED) {
+            in = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+        } else {
+            mf_queue_lock(queue);
+            first = mf_lanes_recv(queue, bufs, n);
+            if (queue->lane_mask != 0)
+                n = first;  // urgent messages left, or one too big for its buffer
+            in = queue->in;
+        }
+        out = *outp;
+        for (i = first; i < n; i++) {
+            int msg_len;
+            int next = mf_ring_recv(queue, in, out, bufs[i].iov_base, bufs[i].iov_len, &msg_len);
+            if (next < 0)
+                break;
+            bufs[i].iov_len = msg_len;
+            out = next;
+        }
+        if (queue->mode != MF_MODE_LOCKED) {
+            __atomic_store_n(outp, out, __ATOMIC_RELEASE);  // hand all bytes back
+        } else {
+            queue->out = out;
+            mf_queue_unlock(queue);
+        }
+        if (i == 0)
+            return -1;  // errno EAGAIN or EMSGSIZE from mf_ring_recv
+        n = i;
+    }
+    mf_msgs_received(queue, n);
+    unsigned long bytes = 0;
+    for (i = 0; i < n; i++)
+        bytes += bufs[i].iov_len;
+    mf_count_deq(queue, n, bytes);
+    mf_space_ready(queue);
+    return n;
+}
+
+static void mf_deadline(struct timespec *deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// one attempt of a send or receive; >= 0 on success, -1 with errno
+// EAGAIN while the queue is full/empty
+typedef int (*mf_try_fn)(mf_queue_t *queue, void *bufptr, int n);
+
+// retry op until it succeeds, following the queue's wait policy: spin
+// with a pause instruction, then yield the CPU, then park on *seq. Each
+// phase is counted once per wait in queue->wait_stats.
+static int mf_wait_op(mf_queue_t *queue, mf_try_fn op, void *bufptr, int n,
+                      int *seq, int *waiters, int timeout_ms) {
+    struct timespec deadline, rel;
+    int i, ret;
+
+    ret = op(queue, bufptr, n);
+    if (ret >= 0 || errno != EAGAIN)
+        return ret;
+    // senders wait on send_waiters: the queue was full, else empty
+    int send = waiters == &queue->send_waiters;
+    __atomic_add_fetch(send ? &mf_qstat(queue)->full : &mf_qstat(queue)->empty, 1, __ATOMIC_RELAXED);
+    if (mf_rearm(queue, send ? MF_EV_SPACE : MF_EV_DATA)) {
+        ret = op(queue, bufptr, n);  // a peer may have come before the re-arm
+        if (ret >= 0 || errno != EAGAIN)
+            return ret;
+    }
+    if (timeout_ms == 0)
+        return ret;
+    if (timeout_ms > 0)
+        mf_deadline(&deadline, timeout_ms);
+
+    if (queue->spin_count > 0) {
+        __atomic_add_fetch(&queue->wait_stats.spins, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < queue->spin_count; i++) {
+            mf_cpu_relax();
+            ret = op(queue, bufptr, n);
+            if (ret >= 0 || errno != EAGAIN)
+                return ret;
+        }
+    }
+
+    if (queue->yield_count > 0) {
+        __atomic_add_fetch(&queue->wait_stats.yields, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < queue->yield_count; i++) {
+            sched_yield();
+            ret = op(queue, bufptr, n);
+            if (ret >= 0 || errno != EAGAIN)
+                return ret;
+            if (timeout_ms > 0 && mf_time_left(&deadline, &rel) != 0)
+                return -1;
+        }
+    }
+
+    __atomic_add_fetch(&queue->wait_stats.parks, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        // register, then re-check before sleeping so a peer that made
+        // progress in between is not missed
+        __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+        int expected = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+        ret = op(queue, bufptr, n);
+        int again = ret < 0 && errno == EAGAIN;
+        int timed_out = 0;
+        if (again)
+            timed_out = mf_park(seq, expected, timeout_ms > 0 ? &deadline : NULL) != 0;
+        __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+        if (!again)
+            return ret;  // done, or failed for good
+        if (timed_out)
+            return -1;
+    }
+}
+
+// what mf_send_prio hands its attempts
+typedef struct {
+    void *bufptr;
+    int prio;
+} mf_prio_msg_t;
+
+// one non-blocking send attempt into a priority lane
+static int mf_queue_send_prio(mf_queue_t *queue, void *arg, int datalen) {
+    mf_prio_msg_t *msg = arg;
+    mf_queue_t *lane = mf_lane(queue, msg->prio);
+
+    if (mf_msgs_take(queue, 1) < 0)
+        return -1;
+    mf_queue_lock(queue);
+    int in = mf_ring_send(lane, lane->in, lane->out, msg->bufptr, datalen);
+    if (in >= 0) {
+        lane->in = in;
+        queue->lane_mask |= 1u << msg->prio;
+    }
+    mf_queue_unlock(queue);
+    if (in < 0) {
+        mf_msgs_untake(queue, 1);
+        return -1;
+    }
+    mf_msgs_sent(queue, 1);
+    mf_count_enq(queue, 1, datalen);
+    mf_data_ready(queue, 1);
+    return 0;
+}
+
+int mf_send_prio(int qid, void *bufptr, int datalen, int prio) {
+    mf_prio_msg_t msg = { bufptr, prio };
+
+    if (prio == 0)
+        return mf_send(qid, bufptr, datalen);
+    if (datalen > MAX_DATALEN || datalen <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;
+    if (prio < 0 || prio >= queue->lanes) {
+        errno = EINVAL;  // the queue has no such lane
+        return -1;
+    }
+    return mf_wait_op(queue, mf_queue_send_prio, &msg, datalen,
+                      &queue->space_seq, &queue->send_waiters, -1) < 0 ? -1 : 0;
+}
+
+int mf_send_timed(int qid, void *bufptr, int datalen, int timeout_ms) {
+    if (datalen > MAX_DATALEN || datalen <= 0) {
+        fprintf(stderr, "Invalid data length.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;  // errno set by mf_queue_at
+    if ((queue->mode == MF_MODE_MPMC && datalen > queue->slot_size) ||
+        (queue->mode == MF_MODE_FIXED && datalen != queue->slot_size)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return mf_wait_op(queue, mf_queue_send, bufptr, datalen,
+                      &queue->space_seq, &queue->send_waiters, timeout_ms);
+}
+
+int mf_recv_timed(int qid, void *bufptr, int bufsize, int timeout_ms) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;  // errno set by mf_queue_at
+    if (mf_check_reader(queue, qid) != 0)
+        return -1;
+
+    return mf_wait_op(queue, mf_queue_recv, bufptr, bufsize,
+                      &queue->data_seq, &queue->recv_waiters, timeout_ms);
+}
+
+int mf_sendv(int qid, const struct iovec *iov, int n) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;
+    if (n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (iov[i].iov_len > MAX_DATALEN || iov[i].iov_len == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((queue->mode == MF_MODE_MPMC && (int)iov[i].iov_len > queue->slot_size) ||
+            (queue->mode == MF_MODE_FIXED && (int)iov[i].iov_len != queue->slot_size)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    return mf_wait_op(queue, mf_queue_sendv, (void *)iov, n,
+                      &queue->space_seq, &queue->send_waiters, -1);
+}
+
+int mf_recv_batch(int qid, struct iovec *bufs, int n) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL || mf_check_reader(queue, qid) != 0)
+        return -1;
+    if (n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return mf_wait_op(queue, mf_queue_recv_batch, bufs, n,
+                      &queue->data_seq, &queue->recv_waiters, -1);
+}
+
+int mf_get_wait_stats(int qid, mf_wait_stats_t *stats) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;
+
+    stats->spins = __atomic_load_n(&queue->wait_stats.spins, __ATOMIC_RELAXED);
+    stats->yields = __atomic_load_n(&queue->wait_stats.yields, __ATOMIC_RELAXED);
+    stats->parks = __atomic_load_n(&queue->wait_stats.parks, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int mf_msg_count(int qid) {
+    mf_qstats_t stats;
+
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    if (mf_msgs_counted(queue))
+        return mf_msgs_now(queue);
+    mf_get_stats(qid, &stats);
+    return stats.depth;
+}
+
+int mf_above_high(int qid) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    return __atomic_load_n(&queue->above_high, __ATOMIC_RELAXED);
+}
+
+int mf_on_watermark(int qid, mf_watermark_fn fn, void *arg) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->high_wm == 0) {
+        errno = EINVAL;  // the queue has no watermarks
+        return -1;
+    }
+    mf_wm[queue->slot].qid = fn != NULL ? qid : 0;
+    mf_wm[queue->slot].fn = fn;
+    mf_wm[queue->slot].arg = arg;
+    return 0;
+}
+
+int mf_get_stats(int qid, mf_qstats_t *stats) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->name, queue->name, MAX_MQNAMESIZE);
+    stats->mode = queue->mode;
+    stats->size = queue->size;
+    stats->ref_count = queue->ref_count;
+    for (int i = 0; i < MF_STAT_SLOTS; i++) {
+        mf_stat_slot_t *st = &queue->stats[i];
+        stats->enq_msgs += __atomic_load_n(&st->enq_msgs, __ATOMIC_RELAXED);
+        stats->enq_bytes += __atomic_load_n(&st->enq_bytes, __ATOMIC_RELAXED);
+        stats->deq_msgs += __atomic_load_n(&st->deq_msgs, __ATOMIC_RELAXED);
+        stats->deq_bytes += __atomic_load_n(&st->deq_bytes, __ATOMIC_RELAXED);
+        stats->full += __atomic_load_n(&st->full, __ATOMIC_RELAXED);
+        stats->empty += __atomic_load_n(&st->empty, __ATOMIC_RELAXED);
+        stats->lock_waits += __atomic_load_n(&st->lock_waits, __ATOMIC_RELAXED);
+        stats->lock_wait_ns += __atomic_load_n(&st->lock_wait_ns, __ATOMIC_RELAXED);
+        stats->recoveries += __atomic_load_n(&st->recoveries, __ATOMIC_RELAXED);
+    }
+    // slots are read one after another, so a receive can be seen
+    // before the send it took
+    stats->depth = stats->enq_msgs > stats->deq_msgs ? stats->enq_msgs - stats->deq_msgs : 0;
+    if (mf_msgs_counted(queue))
+        stats->depth = mf_msgs_now(queue);  // exact
+    stats->max_msgs = queue->max_msgs;
+    stats->above_high = __atomic_load_n(&queue->above_high, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&queue->peak_bytes, __ATOMIC_RELAXED);
+    stats->segment = shmem_metadata->queue_off[queue->slot] >> MF_SEG_SHIFT;
+    return 0;
+}
+
+int mf_list(int *qids, int max) {
+    int n = 0;
+
+    for (int slot = 0; slot < MF_MAX_QUEUES; slot++) {
+        if (__atomic_load_n(&shmem_metadata->queue_off[slot], __ATOMIC_ACQUIRE) == 0)
+            continue;
+        if (n < max)
+            qids[n] = mf_make_qid(slot);
+        n++;
+    }
+    return n;
+}
+
+int mf_get_latency(int qid, mf_lat_hist_t *hist) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->hist_off == 0) {
+        errno = ENODATA;  // not traced
+        return -1;
+    }
+
+    memcpy(hist, mf_qhist(queue), sizeof(*hist));  // receivers may be adding meanwhile
+    return 0;
+}
+
+unsigned long mf_lat_percentile(const mf_lat_hist_t *hist, double pct) {
+    unsigned long total = 0, want = (unsigned long)(hist->count * pct / 100.0);
+
+    for (int i = 0; i < MF_LAT_BUCKETS; i++) {
+        total += hist->buckets[i];
+        if (total > want)
+            return min(mf_lat_bucket_ns(i), hist->max_ns);
+    }
+    return hist->max_ns;
+}
+
+int mf_reset_latency(int qid) {
+    mf_queue_t *queue = mf_queue_lookup(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->hist_off == 0) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    // a message counted while this runs may survive in one field
+    memset(mf_qhist(queue), 0, sizeof(mf_lat_hist_t));
+    return 0;
+}
+
+int mf_print_latency() {
+    int qids[MF_MAX_QUEUES];
+    int n = min(mf_list(qids, MF_MAX_QUEUES), MF_MAX_QUEUES);
+    mf_qstats_t st;
+    mf_lat_hist_t *hist = malloc(sizeof(*hist));
+
+    if (hist == NULL)
+        return -1;
+    printf("%-16s %12s %10s %10s %10s %10s %10s %10s\n",
+           "queue", "msgs", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int i = 0; i < n; i++) {
+        if (mf_get_latency(qids[i], hist) != 0 || mf_get_stats(qids[i], &st) != 0)
+            continue;  // untraced, or removed meanwhile
+        printf("%-16s %12lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", st.name, hist->count,
+               hist->count ? hist->sum_ns / 1e3 / hist->count : 0.0,
+               mf_lat_percentile(hist, 50) / 1e3, mf_lat_percentile(hist, 90) / 1e3,
+               mf_lat_percentile(hist, 99) / 1e3, mf_lat_percentile(hist, 99.9) / 1e3,
+               hist->max_ns / 1e3);
+    }
+    free(hist);
+    return 0;
+}
+
+// hand out the eventfd of kind and have the queue raise it from now on
+static int mf_watch(int qid, int kind) {
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return -1;
+    if (queue->mode == MF_MODE_BCAST) {
+        errno = EINVAL;  // one eventfd cannot follow many cursors
+        return -1;
+    }
+
+    if (mf_evfds[kind][queue->slot].fd < 0)
+        mf_evfds[kind][queue->slot].qid = 0;  // mfserver failed us before, ask again
+    int fd = mf_queue_evfd(queue, kind);
+    if (fd < 0)
+        return -1;
+    __atomic_store_n(mf_ev_notify(queue, kind), 1, __ATOMIC_SEQ_CST);
+    if (kind == MF_EV_SPACE || mf_queue_ready(queue))
+        mf_notify(queue, kind);  // sent before anybody watched; room is only found by trying
+    return fd;
+}
+
+int mf_get_fd(int qid) {
+    return mf_watch(qid, MF_EV_DATA);
+}
+
+int mf_get_space_fd(int qid) {
+    return mf_watch(qid, MF_EV_SPACE);
+}
+
+int mf_wait_any(const int *qids, int n, int timeout_ms) {
+    struct pollfd pfds[MF_MAX_QUEUES];
+    mf_queue_t *queues[MF_MAX_QUEUES];
+    struct timespec deadline, rel;
+    int i, wait_ms = timeout_ms;
+
+    if (n <= 0 || n > MF_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        queues[i] = mf_queue_at(qids[i]);
+        if (queues[i] == NULL || (pfds[i].fd = mf_get_fd(qids[i])) < 0)
+            return -1;
+        pfds[i].events = POLLIN;
+    }
+    if (timeout_ms > 0)
+        mf_deadline(&deadline, timeout_ms);
+
+    for (;;) {
+        for (i = 0; i < n; i++)
+            if (mf_queue_ready(queues[i]))
+                return qids[i];
+        if (timeout_ms > 0) {
+            if (mf_time_left(&deadline, &rel) != 0)
+                return -1;  // ETIMEDOUT
+            wait_ms = rel.tv_sec * 1000 + rel.tv_nsec / 1000000 + 1;
+        }
+        int ret = poll(pfds, n, wait_ms);
+        if (ret == -1 && errno != EINTR)
+            return -1;
+        if (ret == 0 && timeout_ms == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        // a raised fd whose messages another receiver took is stale
+        for (i = 0; i < n; i++)
+            if ((pfds[i].revents & POLLIN) && !mf_queue_ready(queues[i]))
+                mf_rearm(queues[i], MF_EV_DATA);
+    }
+}
+
+int mf_serve(int timeout_ms) {
+    struct pollfd pfd = { mf_listen_fd, POLLIN, 0 };
+    struct timeval tv = { 1, 0 };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int req[2] = { 0, MF_EV_DATA }, status = 0;
+
+    // without a socket this only sleeps
+    int ret = poll(&pfd, mf_listen_fd >= 0, timeout_ms);
+    if (ret <= 0 || mf_listen_fd < 0)
+        return ret;
+    int conn = accept4(mf_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1)
+        return -1;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));  // a silent client cannot stall us
+
+    // the qid, and the kind of fd unless MF_EV_DATA
+    int len = recv(conn, req, sizeof(req), 0);
+    if (len == sizeof(int) || len == sizeof(req)) {
+        mf_queue_t *queue = mf_queue_lookup(req[0]);
+        int fd = -1;
+        if (req[1] != MF_EV_DATA && req[1] != MF_EV_SPACE)
+            errno = EINVAL;
+        else if (queue != NULL)
+            fd = mf_server_evfd(queue, req[0], req[1]);
+        struct iovec iov = { &status, sizeof(status) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+        if (fd >= 0) {
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+        } else {
+            status = errno;
+        }
+        sendmsg(conn, &msg, MSG_NOSIGNAL);
+    }
+    close(conn);
+    return 1;
+}
+
+int mf_send(int qid, void *bufptr, int datalen) {
+    return mf_send_timed(qid, bufptr, datalen, -1);  // block until there is space
+}
+
+int mf_recv(int qid, void *bufptr, int bufsize) {
+    return mf_recv_timed(qid, bufptr, bufsize, -1);  // block until a message arrives
+}
+
+// Zero-copy sends and receives. mf_send_reserve hands out a pointer to
+// room for the record inside the queue and mf_send_commit publishes it;
+// mf_recv_peek points at the oldest record in place and mf_recv_release
+// frees it. A thread holds at most one reservation and one peeked
+// record at a time. On an MF_MODE_LOCKED queue the queue lock is held
+// from reserve to commit (peek to release), so keep that window short.
+typedef struct {
+    mf_queue_t *queue;  // NULL when nothing is pending
+    mf_queue_t *ring;   // peeked: the queue or the priority lane the record is in
+    int qid;
+    int pos;            // byte ring: offset of the length prefix
+    int len;            // reserved / peeked payload length
+    mf_slot_t *slot;    // MF_MODE_MPMC: the claimed slot
+    unsigned int seq;   // MF_MODE_MPMC: its position, MF_MODE_FIXED: the record's
+    void *data;         // what the caller got
+} mf_zc_t;
+
+static __thread mf_zc_t mf_zc_send, mf_zc_recv;
+static __thread char mf_peek_buf[MAX_DATALEN];  // copy of a peeked record that wraps
+
+static int mf_queue_reserve(mf_queue_t *queue, void *arg, int datalen) {
+    mf_zc_t *zc = arg;
+
+    if (mf_msgs_take(queue, 1) < 0)
+        return -1;  // max_msgs in the queue
+    if (queue->mode == MF_MODE_MPMC) {
+        zc->slot = mf_slots_claim_in(queue, datalen, &zc->seq);
+        if (zc->slot == NULL) {
+            mf_msgs_untake(queue, 1);
+            return -1;
+        }
+        zc->data = mf_slot_data(queue, zc->slot);
+        return 0;
+    }
+    if (queue->mode == MF_MODE_FIXED) {
+        zc->seq = queue->in;
+        if (zc->seq - __atomic_load_n((unsigned int *)&queue->out, __ATOMIC_ACQUIRE) == (unsigned int)queue->nslots) {
+            mf_msgs_untake(queue, 1);
+            errno = EAGAIN;
+            return -1;
+        }
+        zc->data = mf_fixed_at(queue, zc->seq);
+        return 0;
+    }
+    if (queue->mode == MF_MODE_SPSC) {
+        int out = __atomic_load_n(&queue->out, __ATOMIC_ACQUIRE);
+        zc->pos = mf_ring_reserve(queue, queue->in, out, datalen);
+    } else {
+        mf_queue_lock(queue);  // released by mf_send_commit
+        zc->pos = mf_ring_reserve(queue, queue->in, queue->out, datalen);
+        if (zc->pos < 0 && queue->mode == MF_MODE_BCAST) {
+            queue->out = mf_bcast_gate(queue, queue->in);  // the cached gate may be stale
+            zc->pos = mf_ring_reserve(queue, queue->in, queue->out, datalen);
+            if (zc->pos < 0 && mf_bcast_reap(queue) > 0) {
+                queue->out = mf_bcast_gate(queue, queue->in);
+                zc->pos = mf_ring_reserve(queue, queue->in, queue->out, datalen);
+            }
+        }
+        if (zc->pos < 0)
+            mf_queue_unlock(queue);
+    }
+    if (zc->pos < 0) {
+        mf_msgs_untake(queue, 1);
+        return -1;
+    }
+    zc->data = mf_qbuf(queue) + zc->pos + sizeof(int) + queue->stamp;
+    return 0;
+}
+
+static int mf_queue_peek(mf_queue_t *queue, void *arg, int unused) {
+    mf_zc_t *zc = arg;
+    int in;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        zc->slot = mf_slots_claim_out(queue, INT_MAX, &zc->seq);
+        if (zc->slot == NULL)
+            return -1;
+        zc->data = mf_slot_data(queue, zc->slot);
+        return zc->len = zc->slot->len;
+    }
+    if (queue->mode == MF_MODE_FIXED) {
+        zc->seq = queue->out;
+        if (__atomic_load_n((unsigned int *)&queue->in, __ATOMIC_ACQUIRE) == zc->seq) {
+            errno = EAGAIN;
+            return -1;
+        }
+        zc->data = mf_fixed_at(queue, zc->seq);
+        return zc->len = queue->slot_size;
+    }
+    mf_queue_t *ring = queue;
+    if (queue->mode != MF_MODE_LOCKED) {
+        in = __atomic_load_n(&queue->in, __ATOMIC_ACQUIRE);
+    } else {
+        mf_queue_lock(queue);  // released by mf_recv_release
+        ring = mf_lane_pick(queue);
+        in = ring->in;
+    }
+    if (*mf_qout(ring) == in) {
+        if (queue->mode == MF_MODE_LOCKED)
+            mf_queue_unlock(queue);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    zc->ring = ring;
+    zc->pos = *mf_qout(ring);
+    if (*mf_rec_len(ring, zc->pos) == MF_REC_WRAP)
+        zc->pos = 0;
+    zc->len = *mf_rec_len(ring, zc->pos);
+    if (ring->stamp) {
+        unsigned long sent;
+        mf_ring_get(ring, zc->pos + sizeof(int), &sent, sizeof(sent));
+        mf_lat_record(ring, &sent);
+    }
+    if (mf_qmirror(ring) != NULL || zc->pos + (int)sizeof(int) + ring->stamp + zc->len <= ring->size) {
+        zc->data = mf_qbuf(ring) + zc->pos + sizeof(int) + ring->stamp;
+    } else {
+        // sent by plain mf_send across the end of the buffer
+        mf_ring_get(ring, mf_rec_data(ring, zc->pos), mf_peek_buf, zc->len);
+        zc->data = mf_peek_buf;
+    }
+    return zc->len;
+}
+
+void *mf_send_reserve(int qid, int datalen) {
+    if (mf_zc_send.queue != NULL) {
+        errno = EBUSY;  // commit the previous reservation first
+        return NULL;
+    }
+    if (datalen > MAX_DATALEN || datalen <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL)
+        return NULL;
+    if (queue->mode == MF_MODE_FIXED && datalen != queue->slot_size) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if (mf_wait_op(queue, mf_queue_reserve, &mf_zc_send, datalen,
+                   &queue->space_seq, &queue->send_waiters, -1) < 0)
+        return NULL;
+    mf_zc_send.queue = queue;
+    mf_zc_send.qid = qid;
+    mf_zc_send.len = datalen;
+    return mf_zc_send.data;
+}
+
+int mf_send_commit(int qid, int datalen) {
+    mf_zc_t *zc = &mf_zc_send;
+    mf_queue_t *queue = zc->queue;
+
+    if (queue == NULL || zc->qid != qid || datalen <= 0 || datalen > zc->len ||
+        (queue->mode == MF_MODE_FIXED && datalen != zc->len)) {
+        errno = EINVAL;
+        return -1;
+    }
+    zc->queue = NULL;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        mf_slot_publish(queue, zc->slot, zc->seq, datalen);
+    } else if (queue->mode == MF_MODE_FIXED) {
+        __atomic_store_n((unsigned int *)&queue->in, zc->seq + 1, __ATOMIC_RELEASE);  // publish the record
+    } else {
+        *mf_rec_len(queue, zc->pos) = datalen;
+        if (queue->stamp) {
+            unsigned long now = mf_now_ns();
+            memcpy(mf_qbuf(queue) + zc->pos + sizeof(int), &now, sizeof(now));  // reserved contiguous
+        }
+        int in = (zc->pos + mf_rec_size(queue, datalen)) % queue->size;
+        if (queue->mode == MF_MODE_SPSC) {
+            __atomic_store_n(&queue->in, in, __ATOMIC_RELEASE);  // publish the record
+        } else {
+            queue->in = in;
+            mf_queue_unlock(queue);  // taken in mf_send_reserve
+        }
+    }
+    mf_msgs_sent(queue, 1);
+    mf_count_enq(queue, 1, datalen);
+    mf_data_ready(queue, queue->mode == MF_MODE_BCAST ? INT_MAX : 1);
+    return 0;
+}
+
+int mf_send_cancel(int qid) {
+    mf_zc_t *zc = &mf_zc_send;
+    mf_queue_t *queue = zc->queue;
+
+    if (queue == NULL || zc->qid != qid) {
+        errno = EINVAL;
+        return -1;
+    }
+    zc->queue = NULL;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        // hand the slot back if no sender claimed one behind it, else
+        // receivers have to step over it
+        unsigned int next = zc->seq + 1;
+        if (!__atomic_compare_exchange_n((unsigned int *)&queue->in, &next, zc->seq, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            zc->slot->len = MF_SLOT_SKIP;
+            __atomic_store_n(&zc->slot->seq, zc->seq + 1, __ATOMIC_RELEASE);
+            mf_data_ready(queue, INT_MAX);  // records behind it may have parked receivers
+        }
+    } else if (queue->mode != MF_MODE_FIXED) {
+        if (zc->pos != queue->in)
+            *mf_rec_len(queue, queue->in) = 0;  // the wrap marker mf_ring_reserve left
+        if (queue->mode != MF_MODE_SPSC)
+            mf_queue_unlock(queue);  // taken in mf_send_reserve
+    }
+    mf_msgs_untake(queue, 1);
+    return 0;
+}
+
+void *mf_recv_peek(int qid, int *datalen) {
+    if (mf_zc_recv.queue != NULL) {
+        errno = EBUSY;  // release the previous record first
+        return NULL;
+    }
+    mf_queue_t *queue = mf_queue_at(qid);
+    if (queue == NULL || mf_check_reader(queue, qid) != 0)
+        return NULL;
+
+    if (mf_wait_op(queue, mf_queue_peek, &mf_zc_recv, 0,
+                   &queue->data_seq, &queue->recv_waiters, -1) < 0)
+        return NULL;
+    mf_zc_recv.queue = queue;
+    mf_zc_recv.qid = qid;
+    *datalen = mf_zc_recv.len;
+    return mf_zc_recv.data;
+}
+
+int mf_recv_release(int qid) {
+    mf_zc_t *zc = &mf_zc_recv;
+    mf_queue_t *queue = zc->queue;
+
+    if (queue == NULL || zc->qid != qid) {
+        errno = EINVAL;
+        return -1;
+    }
+    zc->queue = NULL;
+
+    if (queue->mode == MF_MODE_MPMC) {
+        mf_slot_free(queue, zc->slot, zc->seq);
+    } else if (queue->mode == MF_MODE_FIXED) {
+        __atomic_store_n((unsigned int *)&queue->out, zc->seq + 1, __ATOMIC_RELEASE);  // hand the slot back
+    } else {
+        int out = (zc->pos + mf_rec_size(zc->ring, zc->len)) % zc->ring->size;
+        if (queue->mode != MF_MODE_LOCKED) {
+            __atomic_store_n(mf_qout(queue), out, __ATOMIC_RELEASE);  // hand the bytes back
+        } else {
+            mf_lane_taken(queue, zc->ring, out);
+            mf_queue_unlock(queue);  // taken in mf_recv_peek
+        }
+    }
+    mf_msgs_received(queue, 1);
+    mf_count_deq(queue, 1, zc->len);
+    mf_space_ready(queue);
+    return 0;
+}
+
+static const char *mf_mode_name(int mode) {
+    return mode == MF_MODE_SPSC ? "spsc" : mode == MF_MODE_MPMC ? "mpmc" : mode == MF_MODE_BCAST ? "bcast" :
+           mode == MF_MODE_FIXED ? "fixed" : "locked";
+}
+
+int mf_print()
+{
+    int qids[MF_MAX_QUEUES];
+    int n = min(mf_list(qids, MF_MAX_QUEUES), MF_MAX_QUEUES);
+    mf_qstats_t st;
+    int kb = 0;
+
+    for (int i = 0; i < shmem_metadata->num_segs; i++)
+        kb += shmem_metadata->seg_size[i] / 1024;
+    printf("region: %d of at most %d segments, %d KB; %ld blobs, %ld KB; %lu directory lock recoveries\n",
+           shmem_metadata->num_segs, shmem_metadata->max_segs, kb, shmem_metadata->blobs,
+           shmem_metadata->blob_bytes / 1024, shmem_metadata->dir_recoveries);
+    printf("%-16s %-6s %6s %5s %8s %8s %12s %12s %12s %12s %10s %10s %10s %10s %6s\n",
+           "queue", "mode", "KB", "open", "depth", "peak KB", "enq msgs", "enq bytes",
+           "deq msgs", "deq bytes", "full", "empty", "lock wait", "lock ms", "recov");
+    for (int i = 0; i < n; i++) {
+        if (mf_get_stats(qids[i], &st) != 0)
+            continue;  // removed meanwhile
+        printf("%-16s %-6s %6d %5d %8lu %8lu %12lu %12lu %12lu %12lu %10lu %10lu %10lu %10.1f %6lu\n",
+               st.name, mf_mode_name(st.mode), st.size / 1024, st.ref_count, st.depth,
+               st.peak_bytes / 1024, st.enq_msgs, st.enq_bytes, st.deq_msgs, st.deq_bytes,
+               st.full, st.empty, st.lock_waits, st.lock_wait_ns / 1e6, st.recoveries);
+    }
     return (0);
 }
 
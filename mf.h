@@ -28,38 +28,360 @@
 
 #define MAX_MQNAMESIZE 128
 // max message queue name sizewhy
-#include <semaphore.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define MF_CACHELINE 64
+// size of a cache line; the producer and consumer indices live on
+// separate lines so lock-free queues do not bounce one line between cores
+
+// queue modes, chosen at create time
+#define MF_MODE_LOCKED 0  // byte ring guarded by the queue lock (default)
+#define MF_MODE_SPSC   1  // lock-free, exactly one sender and one receiver process
+#define MF_MODE_MPMC   2  // lock-free, sequence-numbered slots, any number of senders/receivers
+#define MF_MODE_BCAST  3  // every message goes to every subscriber, see mf_subscribe()
+#define MF_MODE_FIXED  4  // lock-free records of one size in slots, one sender and one receiver, see mf_create_fixed()
+
+#define MF_MAX_SUBS 16
+// max subscribers of one MF_MODE_BCAST queue
+
+// read cursor of one subscriber of a broadcast queue
+typedef struct {
+    int pid;  // subscribed process, 0 for a free cursor
+    int pos;  // index of the next record it reads
+} __attribute__((aligned(MF_CACHELINE))) mf_cursor_t;
+
+#define MF_PRIO_LANES 4
+// max priority lanes of an MF_MODE_LOCKED queue, see mf_send_prio(); lane
+// 0 is the queue's own ring, lanes 1.. get a quarter of its size each
+// (at least 2 * MAX_DATALEN)
+
+#define MF_MPMC_SLOT 248
+// default payload bytes per MPMC slot (one slot is a 256 byte stride)
+
+#define MF_BUDDY_MIN 512
+// smallest block handed out by the shared memory allocator
+#define MF_BUDDY_ORDERS 15
+// block sizes MF_BUDDY_MIN << 0 .. MF_BUDDY_MIN << 14 (= MAX_SHMEMSIZE)
+
+#define MF_MAX_QUEUES (MAX_SHMEMSIZE / MIN_MQSIZE)
+// upper bound on queues in one region, the size of the queue table
+
+#define MF_MAX_SEGMENTS 32
+#define MF_SEG_SHIFT 23
+#define MF_SEG_MASK ((1 << MF_SEG_SHIFT) - 1)
+// The region is the root segment (SHMEM_SIZE) plus up to MF_MAX_SEGMENTS
+// - 1 more of SEGMENT_SIZE, added when a create finds no room. Offsets
+// into the region are (segment << MF_SEG_SHIFT) | offset in the segment;
+// a segment is at most MAX_SHMEMSIZE KB = 1 << MF_SEG_SHIFT bytes. Every
+// block of a queue lives in the segment of its header.
+
+#define MF_QID_SHIFT 10
+// a qid is (generation << MF_QID_SHIFT) | (table slot + 1); a slot gets
+// a new generation on every create, so a qid of a removed queue is caught
+
+#define MF_MAGIC 0x4d465247  // "MFRG"
+#define MF_LAYOUT_VERSION 4
+// The region starts with a header mfserver fills in from the config
+// file: magic, layout version, sizes, limits and the segment table, so
+// mf_connect needs only the shm name. The magic is written last; bump
+// the version whenever shmem_metadata_t or mf_queue_t change.
+
+#define MF_SHMEM_NAME_ENV "MF_SHMEM_NAME"
+#define MF_HUGETLB_DIR_ENV "MF_HUGETLB_DIR"
+#define MF_DEFAULT_SHMEM_NAME "/mf_shmem"
+// where mf_connect finds the region: the MF_SHMEM_NAME environment
+// variable, else SHMEM_NAME of an mf.config in the current directory,
+// else MF_DEFAULT_SHMEM_NAME
+
+#define MF_DIR_SIZE (2 * MF_MAX_QUEUES)
+// buckets of the open-addressed name -> queue hash, a power of 2
+
+// one bucket of the queue directory
+typedef struct {
+    unsigned int hash;  // hash of the queue name
+    int slot;           // queue table slot + 1, 0 for an empty bucket
+} mf_dirent_t;
+
+#define MF_MAX_QCONF 16
+// max number of per-queue QUEUE entries taken from the config file
+
+#define MF_WAIT_SPIN  200 // default pause-spins before a blocked send/recv yields
+#define MF_WAIT_YIELD 4   // default sched_yield()s before it parks on the futex
+// WAIT_SPIN / WAIT_YIELD in the config file and SPIN= / YIELD= on a QUEUE
+// entry override these; 0 and 0 means park right away
+
+// queue attributes given to mf_create_attr(); see mf_qattr_init()
+typedef struct {
+    int mode;         // MF_MODE_*
+    int slot_size;    // MF_MODE_MPMC: max payload bytes of one slot, MF_MODE_FIXED: the record size
+    int nslots;       // MF_MODE_FIXED: slots, a power of 2, 0 for as many as the queue size holds
+    int spin_count;   // pause-spins before yielding, -1 for the config default
+    int yield_count;  // yields before parking, -1 for the config default
+    int mirror;       // byte ring modes: map the buffer twice, -1 for the config default
+    int trace;        // stamp messages and keep a latency histogram, -1 for the config default
+    int lanes;        // MF_MODE_LOCKED: priority lanes, 1 .. MF_PRIO_LANES
+    int max_msgs;     // most messages in the queue, 0 for no limit, -1 for MAX_MSGS_IN_QUEUE
+    int credits;      // with max_msgs: credits a sender takes at once, 0 or 1 for one per message
+    int high_wm;      // messages at which the high watermark is raised, 0 for none
+    int low_wm;       // messages at which it is lowered again, -1 for high_wm / 2
+} mf_qattr_t;
+
+// called in the process whose send raised (high 1) or whose receive
+// lowered (high 0) the watermark of queue qid, see mf_on_watermark()
+typedef void (*mf_watermark_fn)(int qid, int high, void *arg);
+
+// how often blocked senders/receivers of a queue reached each wait phase
+typedef struct {
+    unsigned long spins;   // waits that started spinning
+    unsigned long yields;  // waits that went on to sched_yield()
+    unsigned long parks;   // waits that ended up sleeping on the futex
+} mf_wait_stats_t;
+
+#define MF_STAT_SLOTS 16
+// counter slots per queue; a process adds to slot pid % MF_STAT_SLOTS, so
+// senders and receivers rarely write the same cache line
+
+// one slot of a queue's live counters, a cache line of its own
+typedef struct {
+    unsigned long enq_msgs, enq_bytes;  // messages / payload bytes sent
+    unsigned long deq_msgs, deq_bytes;  // messages / payload bytes received
+    unsigned long full;                 // sends that found the queue full
+    unsigned long empty;                // receives that found the queue empty
+    unsigned long lock_waits;           // MF_MODE_LOCKED: contended lock acquisitions
+    unsigned long lock_wait_ns;         // time spent waiting in them
+    unsigned long recoveries;           // locks taken over from a dead process, dead subscribers dropped
+} __attribute__((aligned(MF_CACHELINE))) mf_stat_slot_t;
+
+#define MF_LAT_SUB_BITS 4
+#define MF_LAT_SUB (1 << MF_LAT_SUB_BITS)
+#define MF_LAT_BUCKETS ((34 - MF_LAT_SUB_BITS + 1) * MF_LAT_SUB)
+// latency histogram buckets: log-linear, MF_LAT_SUB per power of two
+// (about 6% resolution) up to 2^34 ns (17 s); longer waits land in the last
+
+// send-to-receive latency of a traced queue, see mf_get_latency()
+typedef struct {
+    unsigned long count;   // messages timed
+    unsigned long sum_ns;  // total latency, for the mean
+    unsigned long max_ns;
+    unsigned long buckets[MF_LAT_BUCKETS];
+} mf_lat_hist_t;
+
+// counters of one queue summed over all slots, see mf_get_stats()
+typedef struct {
+    char name[MAX_MQNAMESIZE];
+    int mode;                           // MF_MODE_*
+    int size;                           // buffer bytes
+    int ref_count;                      // mf_open()s not yet closed
+    unsigned long enq_msgs, enq_bytes;
+    unsigned long deq_msgs, deq_bytes;
+    unsigned long full, empty;
+    unsigned long lock_waits, lock_wait_ns;
+    unsigned long recoveries;
+    unsigned long depth;                // messages in the queue now
+    int max_msgs;                       // message limit, 0 for none
+    int above_high;                     // 1 while the high watermark is raised
+    unsigned long peak_bytes;           // most buffer bytes ever in use
+    int segment;                        // segment of the region the queue lives in
+} mf_qstats_t;
 
 typedef struct {
     char name[MAX_MQNAMESIZE];     // Name of the message queue
     int size;                      // Size of the queue buffer (in bytes)
-    int in;                        // Index for next enqueue (write)
-    int out;                       // Index for next dequeue (read)
+    int mode;                      // MF_MODE_* the queue was created with
     int ref_count;                 // Reference count for open/close operations
-    char buffer[];                 // Flexible array member for the queue buffer
-} mf_queue_t;
+    int slot_size;                 // MF_MODE_MPMC: payload bytes per slot, MF_MODE_FIXED: bytes per record
+    int slot_stride;               // MF_MODE_MPMC/FIXED: bytes between two slots
+    int nslots;                    // MF_MODE_MPMC/FIXED: number of slots, a power of 2
+    int spin_count;                // wait policy: pause-spins before yielding
+    int yield_count;               // wait policy: yields before parking
+    int mirror;                    // processes map the buffer twice back to back
+    int slot;                      // queue table slot, indexes per-process state
+    int stamp;                     // bytes of send timestamp before each payload, 0 if untraced
+    int hist_off;                  // offset of the latency histogram, 0 if untraced
+    int subs_off;                  // MF_MODE_BCAST: offset of the mf_cursor_t[MF_MAX_SUBS]
+    int lanes;                     // priority lanes, 1 for a plain FIFO
+    int lane_off[MF_PRIO_LANES];   // offsets of the headers of lanes 1.., each a ring of its own
+    int prio;                      // in a lane's header: its priority
+    int max_msgs;                  // most messages in the queue, 0 for no limit
+    int credit_batch;              // credits a sender takes from the pool at once, <= 1 for no pool
+    int high_wm, low_wm;           // watermarks in messages, high_wm 0 for none
+    pthread_mutex_t lock;          // robust process-shared lock guarding in/out (MF_MODE_LOCKED, BCAST senders)
+    long reap_ns;                  // MF_MODE_BCAST: when senders last looked for dead subscribers
+    int in __attribute__((aligned(MF_CACHELINE)));   // Index for next enqueue (write)
+    unsigned int lane_mask;        // bit p set while lane p > 0 has messages, under the lock
+    int out __attribute__((aligned(MF_CACHELINE)));  // Index for next dequeue (read), MF_MODE_BCAST: slowest cursor
+    int data_seq __attribute__((aligned(MF_CACHELINE)));  // futex: bumped on send while receivers wait
+    int recv_waiters;              // receivers parked on data_seq
+    int notify;                    // someone holds the queue's eventfd, see mf_get_fd()
+    int ev_pending;                // the eventfd was signalled and nobody re-armed it yet
+    int msgs __attribute__((aligned(MF_CACHELINE)));  // messages sent and not received, if limited or watermarked
+    int credits;                   // credit_batch > 1: credits no sender holds
+    int above_high;                // set at high_wm messages, cleared at low_wm
+    int space_seq __attribute__((aligned(MF_CACHELINE))); // futex: bumped on recv while senders wait
+    int send_waiters;              // senders parked on space_seq
+    int space_notify;              // someone holds the queue's space eventfd, see mf_get_space_fd()
+    int space_pending;             // the space eventfd was signalled and nobody re-armed it yet
+    mf_wait_stats_t wait_stats __attribute__((aligned(MF_CACHELINE)));  // slow path only
+    int peak_bytes;                // high-water mark of buffer bytes in use
+    int buffer_off;                // offset of the queue buffer from the region start
+    mf_stat_slot_t stats[MF_STAT_SLOTS];  // live counters, see mf_get_stats()
+} __attribute__((aligned(MF_CACHELINE))) mf_queue_t;
 
 // Shared memory layout structure
 typedef struct {
+    unsigned int magic;            // MF_MAGIC once mf_init has laid out the region
+    int version;                   // MF_LAYOUT_VERSION of that layout
+    int header_size;               // sizeof(shmem_metadata_t) of that layout
+    int region_size;               // SHMEM_SIZE in bytes, the root segment
+    int max_queues;                // MAX_QUEUES_IN_SHMEM from the config file
+    int max_msgs;                  // MAX_MSGS_IN_QUEUE from the config file
+    int huge_pages;                // HUGE_PAGES from the config file
+    int prefault;                  // PREFAULT from the config file
+    int lock_pages;                // MLOCK from the config file
+    char hugetlb_dir[MAXFILENAME]; // HUGETLB_DIR from the config file
     int num_queues;
+    int num_qconf;                 // number of QUEUE entries read by mf_init
+    int wait_spin;                 // WAIT_SPIN from the config file
+    int wait_yield;                // WAIT_YIELD from the config file
+    int mirror_rings;              // MIRROR_RINGS from the config file
+    int trace_latency;             // TRACE_LATENCY from the config file
+    int queue_off[MF_MAX_QUEUES];  // table slot -> offset of the queue header, 0 if unused
+    int queue_gen[MF_MAX_QUEUES];  // table slot -> generation of the queue in it
+    int next_slot;                 // where mf_create starts looking for a free slot
+    pthread_mutex_t dir_lock;      // robust process-shared lock for create/remove and the allocators
+    unsigned long dir_recoveries;  // times dir_lock was taken over from a dead process
+    unsigned int dir_seq;          // odd while the directory is being changed
+    mf_dirent_t dir[MF_DIR_SIZE];  // queue name -> table slot
+    int num_segs;                  // segments in use, the root one included
+    int max_segs;                  // MAX_SEGMENTS from the config file
+    int seg_grow;                  // SEGMENT_SIZE: bytes of each added segment
+    int seg_size[MF_MAX_SEGMENTS]; // bytes of each segment
+    char seg_huge[MF_MAX_SEGMENTS];  // 1 if the segment is a hugetlbfs file, 0 if POSIX shm
+    int buddy_free[MF_MAX_SEGMENTS][MF_BUDDY_ORDERS];  // per segment: offset of the first free block of each order, 0 if none
+    unsigned long blob_free[MF_BUDDY_ORDERS];  // freed blobs of each order: (ABA tag << 32) | offset of the top one
+    long blobs;                    // blobs allocated and not yet freed
+    long blob_bytes;               // their block bytes
+    struct {
+        char name[MAX_MQNAMESIZE];
+        mf_qattr_t attr;
+    } qconf[MF_MAX_QCONF];         // per-queue attributes from the config file
     // Add other metadata fields as needed
-} shmem_metadata_t;
+} __attribute__((aligned(MF_CACHELINE))) shmem_metadata_t;
 
 extern void *global_shmem_addr;  // Pointer to the shared memory
 extern int global_shmem_size;    // Size of the shared memory
 extern int shm_fd;  
-static sem_t *semaphore_id;
 int mf_init();
 int mf_destroy();
 int mf_connect();
+int mf_connect_readonly();  // map the region read-only, for monitors
+int mf_connect_name(const char *shm_name);  // mf_connect to the region with this shm name
 int mf_disconnect();
+// the mf_create* functions return 0, or -1 with errno EINVAL (bad size
+// or attributes), EEXIST, ENOSPC (MAX_QUEUES_IN_SHMEM) or ENOMEM
 int mf_create(char *mqname, int mqsize);
-int mf_remove(char *mqname);
+int mf_create_mode(char *mqname, int mqsize, int mode);
+int mf_create_attr(char *mqname, int mqsize, mf_qattr_t *attr);
+void mf_qattr_init(mf_qattr_t *attr);
+// a queue of nslots (a power of 2) records of exactly slot_size bytes,
+// for one sending and one receiving process: no length in front of a
+// record, none ever wraps around the end of the buffer, and the copy
+// is specialized for common record sizes. Sends of any other length
+// fail with errno EMSGSIZE; receives return slot_size.
+int mf_create_fixed(char *mqname, int slot_size, int nslots);
+int mf_remove(char *mqname);  // -1 with errno ENOENT if there is no such queue
 int mf_open(char *mqname);
 int mf_close(int qid);
+// broadcast queues: a subscriber receives every message sent after it
+// subscribed, through its own cursor; senders block only on the slowest
+// subscriber and drop messages nobody subscribed to. mf_close
+// unsubscribes too.
+int mf_subscribe(int qid);
+int mf_unsubscribe(int qid);
+// readiness: mf_get_fd returns an eventfd (from mfserver) that turns
+// readable when the queue has messages, to put into poll/epoll. On a
+// readable fd receive with timeout 0 until EAGAIN; the empty receive
+// re-arms it. mf_wait_any waits up to timeout_ms (< 0 forever) for any
+// of n queues and returns the qid of one with messages. Not for
+// broadcast queues.
+int mf_get_fd(int qid);
+// the same for senders: mf_get_space_fd returns an eventfd that turns
+// readable when a receive frees room (and at first). On a readable fd
+// send with timeout 0 until EAGAIN; the full send re-arms it.
+int mf_get_space_fd(int qid);
+int mf_wait_any(const int *qids, int n, int timeout_ms);
+// mfserver: answer mf_get_fd requests for up to timeout_ms; returns 1
+// if one was served, 0 on timeout, -1 with errno (EINTR on a signal)
+int mf_serve(int timeout_ms);
 int mf_send (int qid, void *bufptr, int datalen);
+// send into priority lane prio (0 .. lanes - 1, see QUEUE ... LANES= and
+// mf_qattr_t.lanes): receivers always take from the highest lane that
+// has messages, so urgent messages pass bulk traffic. Lane 0 is mf_send.
+int mf_send_prio(int qid, void *bufptr, int datalen, int prio);
 int mf_recv (int qid, void *bufptr, int bufsize);
-int mf_print();
+// mf_send/mf_recv block until the message fits / arrives. The timed
+// variants give up after timeout_ms (errno ETIMEDOUT); 0 tries once
+// (errno EAGAIN), a negative timeout waits forever.
+int mf_send_timed(int qid, void *bufptr, int datalen, int timeout_ms);
+int mf_recv_timed(int qid, void *bufptr, int bufsize, int timeout_ms);
+// batches: mf_sendv sends iov[0..n) as n messages and mf_recv_batch
+// receives up to n messages, bufs[i].iov_len going in as the buffer size
+// and coming out as the message length. Both take the queue once, block
+// until at least one message moves, and return how many did.
+int mf_sendv(int qid, const struct iovec *iov, int n);
+int mf_recv_batch(int qid, struct iovec *bufs, int n);
+int mf_get_wait_stats(int qid, mf_wait_stats_t *stats);
+// message limits and watermarks (MAX_MSGS_IN_QUEUE, QUEUE ... MAXMSGS=
+// CREDITS= HIGH= LOW=, mf_qattr_t): a send that would put more than
+// max_msgs messages in the queue waits like one that finds it full.
+// With credits > 1 a sender takes that many credits from the queue's
+// pool at once and spends them without touching shared memory; credits
+// a process holds go back on mf_close/mf_disconnect. mf_msg_count is
+// the number of messages in the queue (exact for a limited or
+// watermarked queue), mf_above_high tells whether the high watermark is
+// raised, and mf_on_watermark sets this process' callback for the queue
+// (NULL removes it). Not for broadcast queues.
+int mf_msg_count(int qid);
+int mf_above_high(int qid);
+int mf_on_watermark(int qid, mf_watermark_fn fn, void *arg);
+// live counters of a queue; mf_list fills qids with up to max queues and
+// returns how many there are. Both work on a read-only connection.
+int mf_get_stats(int qid, mf_qstats_t *stats);
+int mf_list(int *qids, int max);
+// latency of traced queues: a copy of the histogram (-1 with errno
+// ENODATA for an untraced queue), its pct percentile in ns, and a reset
+// that needs a read-write connection. mf_print_latency prints a summary
+// of every traced queue.
+int mf_get_latency(int qid, mf_lat_hist_t *hist);
+unsigned long mf_lat_percentile(const mf_lat_hist_t *hist, double pct);
+int mf_reset_latency(int qid);
+int mf_print_latency();
+// zero-copy: mf_send_reserve blocks until datalen bytes are free and
+// returns where to write them, mf_send_commit publishes the first datalen
+// (<= reserved) of them, mf_send_cancel drops the reservation unsent.
+// mf_recv_peek blocks for a message and returns it in place,
+// mf_recv_release drops it. One of each may be pending per thread;
+// NULL / -1 with errno on error.
+void *mf_send_reserve(int qid, int datalen);
+int mf_send_commit(int qid, int datalen);
+int mf_send_cancel(int qid);
+void *mf_recv_peek(int qid, int *datalen);
+int mf_recv_release(int qid);
+// payload pool: blocks of up to half a segment in the shared region for
+// messages too big for a queue. A producer takes a blob, fills it in
+// place and sends only its handle; the consumer reads it in place and
+// frees it. Any process may free a blob. mf_blob_alloc returns the
+// handle (and in *ptr the memory) or -1 with errno ENOMEM;
+// mf_blob_ptr returns the memory of a handle and in *size its capacity.
+// mf_send_blob / mf_recv_blob send and receive a handle together with
+// the length of the data in the blob.
+int mf_blob_alloc(int size, void **ptr);
+void *mf_blob_ptr(int handle, int *size);
+int mf_blob_free(int handle);
+int mf_send_blob(int qid, int handle, int datalen);
+int mf_recv_blob(int qid, int *datalen);
+int mf_print();  // table of all queues and their counters on stdout
 
 #endif
 
@@ -0,0 +1,366 @@
+#ifndef _MF_HPP_
+#define _MF_HPP_
+
+// C++ interface to the MF library: header-only, C++20, a thin layer over
+// the C functions of mf.h (link with -lmf -lrt -lpthread as before).
+//
+//   mf::Connection conn;                 // mf_connect .. mf_disconnect
+//   mf::create_fixed<order_t>("orders", 1024);
+//   mf::Queue<order_t> q("orders");      // mf_open .. mf_close
+//   q.send(order);                       // blocks like mf_send
+//   order_t o = q.recv();
+//
+// mf::Queue<T> carries records of one trivially copyable type. Its
+// send and recv reserve the record in the queue and copy sizeof(T)
+// bytes there with a memcpy of constant size, which the compiler
+// inlines, instead of passing a pointer and a length into the library.
+// mf::ByteQueue carries messages of any length as std::span<std::byte>.
+// Both can peek a message in place: peek() returns an mf::View that
+// releases it when it goes out of scope. Zero-copy state is per thread,
+// so a thread holds one reservation and one view at a time.
+//
+// Failures throw mf::Error, a std::system_error with the errno of the
+// C call. The try_ variants return false / std::nullopt instead when
+// the queue stays full / empty for timeout_ms (0: try once).
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <sys/uio.h>
+
+extern "C" {
+#include "mf.h"
+}
+#undef min  // mf.h's macro would break std::min and std::numeric_limits<>::min
+
+namespace mf {
+
+class Error : public std::system_error {
+public:
+    explicit Error(const char *what, int err = errno) : std::system_error(err, std::generic_category(), what) {}
+};
+
+namespace detail {
+
+// rc of a timed C call: true if it only timed out or found the queue
+// full/empty, false on success; throws on any other failure
+inline bool timed_out(int rc, const char *what) {
+    if (rc >= 0)
+        return false;
+    if (errno == EAGAIN || errno == ETIMEDOUT)
+        return true;
+    throw Error(what);
+}
+
+// a commit failed: give the reservation back, which unlocks the queue,
+// and throw with the errno of the commit
+[[noreturn]] inline void cancel_send(int qid, const char *what) {
+    Error e(what);
+    mf_send_cancel(qid);
+    throw e;
+}
+
+// C names are char *, though never written
+inline char *c_name(const char *name) {
+    return const_cast<char *>(name);
+}
+
+}  // namespace detail
+
+// a connection to the region for the lifetime of the object; one per
+// process, made before any queue is opened
+class Connection {
+public:
+    Connection() {
+        if (mf_connect() != 0)
+            throw Error("mf_connect");
+    }
+    explicit Connection(const char *shm_name) {
+        if (mf_connect_name(shm_name) != 0)
+            throw Error("mf_connect_name");
+    }
+    ~Connection() { mf_disconnect(); }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+};
+
+inline void create(const char *name, int size_kb, const mf_qattr_t &attr) {
+    mf_qattr_t a = attr;
+    if (mf_create_attr(detail::c_name(name), size_kb, &a) != 0)
+        throw Error("mf_create_attr");
+}
+
+inline void create(const char *name, int size_kb, int mode = MF_MODE_LOCKED) {
+    mf_qattr_t attr;
+    mf_qattr_init(&attr);
+    attr.mode = mode;
+    create(name, size_kb, attr);
+}
+
+// a MF_MODE_FIXED queue of nslots records of T
+template <class T>
+void create_fixed(const char *name, int nslots) {
+    static_assert(sizeof(T) <= MAX_DATALEN, "T is larger than MAX_DATALEN");
+    if (mf_create_fixed(detail::c_name(name), sizeof(T), nslots) != 0)
+        throw Error("mf_create_fixed");
+}
+
+inline void remove(const char *name) {
+    if (mf_remove(detail::c_name(name)) != 0)
+        throw Error("mf_remove");
+}
+
+// a message peeked in place, released (mf_recv_release) on destruction
+class View {
+public:
+    View(View &&other) noexcept : qid_(std::exchange(other.qid_, -1)), data_(other.data_) {}
+    View(const View &) = delete;
+    View &operator=(const View &) = delete;
+    ~View() { release(); }
+
+    std::span<const std::byte> bytes() const { return data_; }
+    std::size_t size() const { return data_.size(); }
+
+    // a copy of the message as a T; the bytes in the queue are only
+    // 4-byte aligned, so it is not handed out as a reference
+    template <class T>
+    T as() const {
+        static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+        if (data_.size() != sizeof(T))
+            throw Error("mf::View::as", EBADMSG);
+        T v;
+        std::memcpy(&v, data_.data(), sizeof(T));
+        return v;
+    }
+
+    void release() {
+        if (qid_ >= 0)
+            mf_recv_release(std::exchange(qid_, -1));
+    }
+
+private:
+    friend class QueueBase;
+    View(int qid, const void *data, int len) : qid_(qid), data_(static_cast<const std::byte *>(data), len) {}
+
+    int qid_;
+    std::span<const std::byte> data_;
+};
+
+// an open queue (mf_open .. mf_close) and what does not depend on the
+// message type
+class QueueBase {
+public:
+    QueueBase(QueueBase &&other) noexcept : qid_(std::exchange(other.qid_, -1)) {}
+    QueueBase &operator=(QueueBase &&other) noexcept {
+        if (this != &other) {
+            close();
+            qid_ = std::exchange(other.qid_, -1);
+        }
+        return *this;
+    }
+    QueueBase(const QueueBase &) = delete;
+    QueueBase &operator=(const QueueBase &) = delete;
+    ~QueueBase() { close(); }
+
+    int qid() const { return qid_; }
+
+    void close() {
+        if (qid_ >= 0)
+            mf_close(std::exchange(qid_, -1));
+    }
+
+    // the oldest message in place, see View
+    View peek() {
+        int len;
+        void *data = mf_recv_peek(qid_, &len);
+        if (data == nullptr)
+            throw Error("mf_recv_peek");
+        return View(qid_, data, len);
+    }
+
+    // readiness eventfd for poll/epoll, owned by the library
+    int fd() const {
+        int fd = mf_get_fd(qid_);
+        if (fd < 0)
+            throw Error("mf_get_fd");
+        return fd;
+    }
+
+    // the same for room to send, see mf_get_space_fd
+    int space_fd() const {
+        int fd = mf_get_space_fd(qid_);
+        if (fd < 0)
+            throw Error("mf_get_space_fd");
+        return fd;
+    }
+
+    int count() const { return mf_msg_count(qid_); }
+    bool above_high() const { return mf_above_high(qid_) > 0; }
+
+    mf_qstats_t stats() const {
+        mf_qstats_t st;
+        if (mf_get_stats(qid_, &st) != 0)
+            throw Error("mf_get_stats");
+        return st;
+    }
+
+    // MF_MODE_BCAST: receive from now on
+    void subscribe() {
+        if (mf_subscribe(qid_) != 0)
+            throw Error("mf_subscribe");
+    }
+
+protected:
+    explicit QueueBase(const char *name) : qid_(mf_open(detail::c_name(name))) {
+        if (qid_ < 0)
+            throw Error("mf_open");
+    }
+
+    int qid_;
+};
+
+// records of type T. The size is a compile-time constant everywhere:
+// send and recv copy exactly sizeof(T) bytes, inline, straight between
+// the record and the queue.
+template <class T>
+class Queue : public QueueBase {
+    static_assert(std::is_trivially_copyable_v<T>, "mf::Queue<T> copies T bytewise; use mf::ByteQueue for other types");
+    static_assert(sizeof(T) >= MIN_DATALEN && sizeof(T) <= MAX_DATALEN, "T does not fit in a message");
+
+public:
+    explicit Queue(const char *name) : QueueBase(name) {}
+    explicit Queue(const std::string &name) : QueueBase(name.c_str()) {}
+
+    void send(const T &v) {
+        void *slot = mf_send_reserve(qid_, sizeof(T));
+        if (slot == nullptr)
+            throw Error("mf_send_reserve");
+        std::memcpy(slot, &v, sizeof(T));
+        if (mf_send_commit(qid_, sizeof(T)) != 0)
+            detail::cancel_send(qid_, "mf_send_commit");
+    }
+
+    T recv() {
+        int len;
+        void *data = mf_recv_peek(qid_, &len);
+        if (data == nullptr)
+            throw Error("mf_recv_peek");
+        if (len != static_cast<int>(sizeof(T))) {
+            mf_recv_release(qid_);
+            throw Error("mf::Queue::recv", EBADMSG);  // not sent as a T
+        }
+        T v;
+        std::memcpy(&v, data, sizeof(T));
+        mf_recv_release(qid_);
+        return v;
+    }
+
+    bool try_send(const T &v, int timeout_ms = 0) {
+        return !detail::timed_out(mf_send_timed(qid_, const_cast<T *>(&v), sizeof(T), timeout_ms), "mf_send_timed");
+    }
+
+    std::optional<T> try_recv(int timeout_ms = 0) {
+        T v;
+        int len = mf_recv_timed(qid_, &v, sizeof(T), timeout_ms);
+        if (detail::timed_out(len, "mf_recv_timed"))
+            return std::nullopt;
+        if (len != static_cast<int>(sizeof(T)))
+            throw Error("mf::Queue::try_recv", EBADMSG);
+        return v;
+    }
+
+    // send as many of items as fit at once (at least one, blocking);
+    // returns how many
+    std::size_t send_batch(std::span<const T> items) {
+        struct iovec iov[MF_BATCH];
+        int n = static_cast<int>(std::min<std::size_t>(items.size(), MF_BATCH));
+        for (int i = 0; i < n; i++)
+            iov[i] = { const_cast<T *>(&items[i]), sizeof(T) };
+        int sent = mf_sendv(qid_, iov, n);
+        if (sent < 0)
+            throw Error("mf_sendv");
+        return sent;
+    }
+
+    // receive up to out.size() records (at least one, blocking); returns
+    // how many
+    std::size_t recv_batch(std::span<T> out) {
+        struct iovec iov[MF_BATCH];
+        int n = static_cast<int>(std::min<std::size_t>(out.size(), MF_BATCH));
+        for (int i = 0; i < n; i++)
+            iov[i] = { &out[i], sizeof(T) };
+        int got = mf_recv_batch(qid_, iov, n);
+        if (got < 0)
+            throw Error("mf_recv_batch");
+        for (int i = 0; i < got; i++)
+            if (iov[i].iov_len != sizeof(T))
+                throw Error("mf::Queue::recv_batch", EBADMSG);
+        return got;
+    }
+
+private:
+    static constexpr std::size_t MF_BATCH = 64;  // records per mf_sendv / mf_recv_batch call
+};
+
+// messages of any length up to MAX_DATALEN
+class ByteQueue : public QueueBase {
+public:
+    explicit ByteQueue(const char *name) : QueueBase(name) {}
+    explicit ByteQueue(const std::string &name) : QueueBase(name.c_str()) {}
+
+    void send(std::span<const std::byte> msg) {
+        if (mf_send(qid_, const_cast<std::byte *>(msg.data()), msg.size()) != 0)
+            throw Error("mf_send");
+    }
+
+    // the message length; buf must hold it
+    std::size_t recv(std::span<std::byte> buf) {
+        int len = mf_recv(qid_, buf.data(), buf.size());
+        if (len < 0)
+            throw Error("mf_recv");
+        return len;
+    }
+
+    bool try_send(std::span<const std::byte> msg, int timeout_ms = 0) {
+        return !detail::timed_out(mf_send_timed(qid_, const_cast<std::byte *>(msg.data()), msg.size(), timeout_ms),
+                                  "mf_send_timed");
+    }
+
+    std::optional<std::size_t> try_recv(std::span<std::byte> buf, int timeout_ms = 0) {
+        int len = mf_recv_timed(qid_, buf.data(), buf.size(), timeout_ms);
+        if (detail::timed_out(len, "mf_recv_timed"))
+            return std::nullopt;
+        return len;
+    }
+
+    // reserve max_len bytes in the queue, let fill write the message
+    // there and return its length (1..max_len), then publish it. If fill
+    // throws or returns another length, the reservation is cancelled
+    // (mf_send_cancel) and nothing is sent.
+    template <class F>
+    std::size_t send_with(std::size_t max_len, F &&fill) {
+        auto *room = static_cast<std::byte *>(mf_send_reserve(qid_, max_len));
+        if (room == nullptr)
+            throw Error("mf_send_reserve");
+        std::size_t len;
+        try {
+            len = fill(std::span<std::byte>(room, max_len));
+        } catch (...) {
+            mf_send_cancel(qid_);
+            throw;
+        }
+        if (mf_send_commit(qid_, len) != 0)
+            detail::cancel_send(qid_, "mf_send_commit");
+        return len;
+    }
+};
+
+}  // namespace mf
+
+#endif
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mf.h"
+
+// mfbench: throughput and latency of producers and consumers on MF
+// queues. It runs every combination of
+//   -s message sizes, -m queue sizes (KB), -q queue counts,
+//   -p producers and -c consumers per queue, -b batch sizes
+// where each list is "N", "a,b,c" or "lo-hi" (powers of 2 from lo to hi);
+// a single N for -q, -p or -b means 1-N. Each producer sends -n messages.
+// Queue counts above MAX_QUEUES_IN_SHMEM need it raised in mf.config.
+// -t picks the queue mode (spsc and fixed only with one producer and one
+// consumer per queue), -z uses reserve/commit and peek/release
+// instead of copying, a batch above 1 goes through mf_sendv and
+// mf_recv_batch, and -a pins each worker to its own CPU. Queues hold
+// as many messages as fit, whatever MAX_MSGS_IN_QUEUE says; -M caps
+// them at that many messages instead.
+//
+// Messages of 8 bytes or more carry their send time, so consumers can
+// record the send-to-receive latency in a log-linear (HDR-style)
+// histogram. -f csv prints one comma-separated row per run, with the
+// -l label in front, for comparing library versions. The spins/yields/
+// parks columns show how far blocked calls got into the wait policy
+// (WAIT_SPIN/WAIT_YIELD in mf.config). mfserver must be running.
+
+#define MAX_SWEEP 32
+
+// a histogram bucket covers 1/32 of a power of two, about 3% resolution
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+} hist_t;
+
+typedef struct {
+    int vals[MAX_SWEEP];
+    int n;
+} sweep_t;
+
+static sweep_t sizes = { {64}, 1 };
+static sweep_t mqsizes = { {16}, 1 };  // KB
+static sweep_t queues = { {1, 2, 4}, 3 };
+static sweep_t prods = { {1}, 1 };
+static sweep_t conss = { {1}, 1 };
+static sweep_t batches = { {1}, 1 };
+static int nmsgs = 100000;
+static int mode = MF_MODE_LOCKED;
+static int max_msgs = 0;  // mf_qattr_t.max_msgs, 0 for no limit
+static int pin = 0;
+static int zerocopy = 0;
+static int csv = 0;
+static char *label = "";
+static FILE *out;  // results; stdout itself takes the library's chatter
+
+// the run in progress
+static int msgsize, mqsize, batch;
+static mf_wait_stats_t waits;  // summed over the queues of the last run
+static hist_t *hists;          // one per worker, shared with the children
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long v) {
+    if (v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+// largest value that lands in bucket i
+static unsigned long hist_value(int i) {
+    if (i < HIST_SUB)
+        return i;
+    int shift = i / HIST_SUB - 1;
+    return (((unsigned long)(HIST_SUB + i % HIST_SUB) + 1) << shift) - 1;
+}
+
+static void hist_add(hist_t *h, unsigned long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static unsigned long hist_percentile(hist_t *h, double pct) {
+    unsigned long rank = (unsigned long)(h->total * pct / 100.0), seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return min(hist_value(i), h->max);
+    }
+    return h->max;
+}
+
+// stamp the send time into a message / record its latency on receipt
+static void stamp(void *msg) {
+    if (msgsize >= (int)sizeof(unsigned long)) {
+        unsigned long t = now_ns();
+        memcpy(msg, &t, sizeof(t));
+    }
+}
+
+static void record(hist_t *h, const void *msg) {
+    if (msgsize >= (int)sizeof(unsigned long)) {
+        unsigned long t;
+        memcpy(&t, msg, sizeof(t));
+        hist_add(h, now_ns() - t);
+    }
+}
+
+static void check_len(int len) {
+    if (len != msgsize) {
+        fprintf(stderr, "mfbench: got %d bytes, expected %d\n", len, msgsize);
+        exit(1);
+    }
+}
+
+// move total messages batch at a time with mf_sendv/mf_recv_batch
+static void run_batched(int qid, int sender, int total, hist_t *h) {
+    struct iovec *iov = malloc(batch * sizeof(struct iovec));
+    char *buffers = malloc(sender ? msgsize : (size_t)batch * MAX_DATALEN);
+    int i, count = 0;
+
+    memset(buffers, 'x', sender ? msgsize : 1);
+    while (count < total) {
+        int n = min(batch, total - count);
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = sender ? buffers : buffers + (size_t)i * MAX_DATALEN;
+            iov[i].iov_len = sender ? msgsize : MAX_DATALEN;
+        }
+        if (sender)
+            stamp(buffers);  // the whole batch is ready at once
+        int ret = sender ? mf_sendv(qid, iov, n) : mf_recv_batch(qid, iov, n);
+        if (ret < 0) {
+            perror("mfbench");
+            exit(1);
+        }
+        for (i = 0; !sender && i < ret; i++) {
+            check_len(iov[i].iov_len);
+            record(h, iov[i].iov_base);
+        }
+        count += ret;
+    }
+    free(buffers);
+    free(iov);
+}
+
+// move total messages one at a time, copying or in place
+static void run_single(int qid, int sender, int total, hist_t *h) {
+    char buffer[MAX_DATALEN];
+    int count = 0;
+
+    memset(buffer, 'x', msgsize);
+    while (count < total) {
+        int ret;
+        if (zerocopy) {
+            // write straight into the queue / read the record in place
+            char *p = sender ? mf_send_reserve(qid, msgsize) : mf_recv_peek(qid, &ret);
+            if (p == NULL) {
+                perror("mfbench");
+                exit(1);
+            }
+            if (sender) {
+                memset(p, 'x', msgsize);
+                stamp(p);
+                ret = mf_send_commit(qid, msgsize);
+            } else {
+                check_len(ret);
+                record(h, p);
+                mf_recv_release(qid);
+            }
+        } else if (sender) {
+            stamp(buffer);
+            ret = mf_send(qid, buffer, msgsize);  // blocks until the peer made room
+        } else {
+            ret = mf_recv(qid, buffer, MAX_DATALEN);  // blocks until something arrives
+            if (ret >= 0) {
+                check_len(ret);
+                record(h, buffer);
+            }
+        }
+        if (ret < 0) {
+            perror("mfbench");
+            exit(1);
+        }
+        count++;
+    }
+}
+
+// child side: report ready on readyfd, wait for the start signal on gofd
+// (closed by the parent), then move total messages
+static void run_worker(char *mqname, int sender, int total, int id, int readyfd, int gofd) {
+    char c = 0;
+    int qid;
+
+    if (pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    mf_connect();
+    qid = mf_open(mqname);
+    if (qid < 0) {
+        fprintf(stderr, "mfbench: cannot open %s\n", mqname);
+        exit(1);
+    }
+
+    write(readyfd, &c, 1);
+    read(gofd, &c, 1);  // returns 0 when the parent closes the pipe
+
+    if (batch > 1)
+        run_batched(qid, sender, total, &hists[id]);
+    else
+        run_single(qid, sender, total, &hists[id]);
+    mf_close(qid);
+    mf_disconnect();
+    exit(0);
+}
+
+// one run; returns the elapsed seconds and merges the consumers'
+// histograms into h
+static double run_queues(int nqueues, int nprod, int ncons, hist_t *h) {
+    char mqname[MAX_MQNAMESIZE];
+    int nworkers = nqueues * (nprod + ncons);
+    int ready[2], go[2];
+    char c;
+    int i, j;
+
+    for (i = 0; i < nqueues; i++) {
+        snprintf(mqname, sizeof(mqname), "bench%d", i);
+        mf_qattr_t attr;
+        mf_qattr_init(&attr);
+        attr.mode = mode;
+        attr.max_msgs = max_msgs;
+        if (mode == MF_MODE_FIXED)
+            attr.slot_size = msgsize;  // records of the message size, as many as fit in mqsize KB
+        if (mf_create_attr(mqname, mqsize, &attr) != 0) {
+            fprintf(stderr, "mfbench: cannot create %s\n", mqname);
+            exit(1);
+        }
+    }
+
+    hists = mmap(NULL, nworkers * sizeof(hist_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (hists == MAP_FAILED) {
+        perror("mfbench");
+        exit(1);
+    }
+
+    pipe(ready);
+    pipe(go);
+    for (i = 0; i < nworkers; i++) {
+        if (fork() == 0) {
+            int q = i / (nprod + ncons), role = i % (nprod + ncons);
+            int total = nmsgs;
+            if (role >= nprod) {
+                // consumers split everything the producers of the queue send
+                j = role - nprod;
+                total = nmsgs * nprod / ncons + (j < nmsgs * nprod % ncons);
+            }
+            close(ready[0]);
+            close(go[1]);
+            snprintf(mqname, sizeof(mqname), "bench%d", q);
+            run_worker(mqname, role < nprod, total, i, ready[1], go[0]);
+        }
+    }
+    close(ready[1]);
+    close(go[0]);
+    for (i = 0; i < nworkers; i++)
+        read(ready[0], &c, 1);
+
+    double start = now_sec();
+    close(go[1]);  // release all workers at once
+    for (i = 0; i < nworkers; i++)
+        wait(NULL);
+    double elapsed = now_sec() - start;
+    close(ready[0]);
+
+    memset(h, 0, sizeof(*h));
+    for (i = 0; i < nworkers; i++) {
+        for (j = 0; j < HIST_BUCKETS; j++)
+            h->counts[j] += hists[i].counts[j];
+        h->total += hists[i].total;
+        if (hists[i].max > h->max)
+            h->max = hists[i].max;
+    }
+    munmap(hists, nworkers * sizeof(hist_t));
+
+    memset(&waits, 0, sizeof(waits));
+    for (i = 0; i < nqueues; i++) {
+        mf_wait_stats_t stats;
+        snprintf(mqname, sizeof(mqname), "bench%d", i);
+        if (mf_get_wait_stats(mf_open(mqname), &stats) == 0) {
+            waits.spins += stats.spins;
+            waits.yields += stats.yields;
+            waits.parks += stats.parks;
+        }
+        mf_remove(mqname);
+    }
+    return elapsed;
+}
+
+// parse "N", "a,b,c" or "lo-hi"; a single N becomes 1-N if upto is set
+static void parse_sweep(sweep_t *sw, char *arg, int upto) {
+    char *dash = strchr(arg, '-');
+
+    sw->n = 0;
+    if (dash != NULL || (upto && strchr(arg, ',') == NULL)) {
+        int lo = dash != NULL ? atoi(arg) : 1;
+        int hi = dash != NULL ? atoi(dash + 1) : atoi(arg);
+        for (int v = lo; v > 0 && v <= hi && sw->n < MAX_SWEEP; v *= 2)
+            sw->vals[sw->n++] = v;
+    } else {
+        for (char *tok = strtok(arg, ","); tok != NULL && sw->n < MAX_SWEEP; tok = strtok(NULL, ","))
+            sw->vals[sw->n++] = atoi(tok);
+    }
+    for (int i = 0; i < sw->n; i++) {
+        if (sw->vals[i] <= 0)
+            sw->n = 0;
+    }
+    if (sw->n == 0) {
+        fprintf(stderr, "mfbench: invalid list %s\n", arg);
+        exit(1);
+    }
+}
+
+static const char *mode_name() {
+    return mode == MF_MODE_SPSC ? "spsc" : mode == MF_MODE_MPMC ? "mpmc" : mode == MF_MODE_FIXED ? "fixed" : "locked";
+}
+
+static void print_header() {
+    if (csv) {
+        fprintf(out, "label,mode,zerocopy,queues,producers,consumers,msgsize,mqsize_kb,batch,"
+               "seconds,msgs_per_sec,gb_per_sec,p50_ns,p99_ns,p999_ns,max_ns,spins,yields,parks\n");
+        return;
+    }
+    fprintf(out, "%6s %5s %5s %7s %6s %5s %8s %12s %8s %9s %9s %9s %9s %8s %8s %8s\n",
+           "queues", "prod", "cons", "msgsize", "mqsize", "batch", "seconds", "msgs/sec",
+           "GB/s", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "spins", "yields", "parks");
+}
+
+static void print_run(int q, int p, int c, double elapsed, hist_t *h) {
+    double msgs = (double)q * p * nmsgs;
+    double rate = msgs / elapsed, gbps = msgs * msgsize / elapsed / 1e9;
+    unsigned long p50 = hist_percentile(h, 50), p99 = hist_percentile(h, 99);
+    unsigned long p999 = hist_percentile(h, 99.9);
+
+    if (csv) {
+        fprintf(out, "%s,%s,%d,%d,%d,%d,%d,%d,%d,%.6f,%.0f,%.4f,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+               label, mode_name(), zerocopy, q, p, c, msgsize, mqsize, batch, elapsed, rate, gbps,
+               p50, p99, p999, h->max, waits.spins, waits.yields, waits.parks);
+        return;
+    }
+    fprintf(out, "%6d %5d %5d %7d %6d %5d %8.3f %12.0f %8.3f %9.1f %9.1f %9.1f %9.1f %8lu %8lu %8lu\n",
+           q, p, c, msgsize, mqsize, batch, elapsed, rate, gbps, p50 / 1e3, p99 / 1e3,
+           p999 / 1e3, h->max / 1e3, waits.spins, waits.yields, waits.parks);
+}
+
+int
+main(int argc, char **argv)
+{
+    static hist_t hist;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:q:p:c:m:t:b:f:l:M:az")) != -1) {
+        switch (opt) {
+        case 'n': nmsgs = atoi(optarg); break;
+        case 's': parse_sweep(&sizes, optarg, 0); break;
+        case 'q': parse_sweep(&queues, optarg, 1); break;
+        case 'p': parse_sweep(&prods, optarg, 1); break;
+        case 'c': parse_sweep(&conss, optarg, 0); break;
+        case 'm': parse_sweep(&mqsizes, optarg, 0); break;
+        case 'b': parse_sweep(&batches, optarg, 1); break;
+        case 'l': label = optarg; break;
+        case 'M': max_msgs = atoi(optarg); break;
+        case 'a': pin = 1; break;
+        case 'z': zerocopy = 1; break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                csv = 1;
+            else if (strcmp(optarg, "table") != 0) {
+                fprintf(stderr, "mfbench: unknown format %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "spsc") == 0)
+                mode = MF_MODE_SPSC;
+            else if (strcmp(optarg, "mpmc") == 0)
+                mode = MF_MODE_MPMC;
+            else if (strcmp(optarg, "locked") == 0)
+                mode = MF_MODE_LOCKED;
+            else if (strcmp(optarg, "fixed") == 0)
+                mode = MF_MODE_FIXED;
+            else {
+                fprintf(stderr, "mfbench: unknown queue mode %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("usage: mfbench [-n msgs] [-s msgsizes] [-m mqsizesKB] [-q queues] [-p producers] "
+                   "[-c consumers] [-b batches] [-t locked|spsc|mpmc|fixed] [-f table|csv] [-l label] [-M maxmsgs] [-a] [-z]\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < sizes.n; i++) {
+        if (sizes.vals[i] < MIN_DATALEN || sizes.vals[i] > MAX_DATALEN) {
+            fprintf(stderr, "mfbench: message size %d out of bounds\n", sizes.vals[i]);
+            exit(1);
+        }
+    }
+    if (nmsgs <= 0 || max_msgs < 0) {
+        fprintf(stderr, "mfbench: invalid arguments\n");
+        exit(1);
+    }
+    // one sender and one receiver process only, more would corrupt the ring
+    if (mode == MF_MODE_SPSC || mode == MF_MODE_FIXED) {
+        for (int i = 0; i < prods.n || i < conss.n; i++) {
+            if ((i < prods.n && prods.vals[i] > 1) || (i < conss.n && conss.vals[i] > 1)) {
+                fprintf(stderr, "mfbench: -t %s takes one producer and one consumer (-p 1 -c 1)\n",
+                        mode == MF_MODE_SPSC ? "spsc" : "fixed");
+                exit(1);
+            }
+        }
+    }
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+    mf_connect();
+    print_header();
+    fflush(out);  // workers are forked with a copy of the stdio buffer
+    for (int si = 0; si < sizes.n; si++) {
+        msgsize = sizes.vals[si];
+        for (int mi = 0; mi < mqsizes.n; mi++) {
+            mqsize = mqsizes.vals[mi];
+            for (int qi = 0; qi < queues.n; qi++) {
+                for (int pi = 0; pi < prods.n; pi++) {
+                    for (int ci = 0; ci < conss.n; ci++) {
+                        for (int bi = 0; bi < batches.n; bi++) {
+                            int q = queues.vals[qi], p = prods.vals[pi], c = conss.vals[ci];
+                            batch = batches.vals[bi];
+                            double elapsed = run_queues(q, p, c, &hist);
+                            print_run(q, p, c, elapsed, &hist);
+                            fflush(out);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    mf_disconnect();
+    return 0;
+}
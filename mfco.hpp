@@ -0,0 +1,326 @@
+#ifndef _MFCO_HPP_
+#define _MFCO_HPP_
+
+// C++20 coroutines on MF queues, for single-threaded event loops:
+//
+//   mf::Task consume(mf::Queue<order_t> &q) {
+//       for (;;) {
+//           order_t o = co_await mf::recv(q);
+//           ...
+//           co_await mf::send(replies, reply);
+//       }
+//   }
+//
+//   mf::Reactor reactor;
+//   reactor.spawn(consume(q));   // as many as there are queues
+//   reactor.run();               // until every task returned
+//
+// co_await mf::recv/mf::send try the queue once; if it is empty/full
+// the coroutine is suspended and the reactor parks it on the queue's
+// readiness eventfd (mf_get_fd, mf_get_space_fd) in epoll. When the fd
+// turns readable the reactor tries again for the coroutines waiting on
+// it, oldest first, and resumes those that got through. A failed try
+// re-arms the fd, so nothing is polled: one thread can wait on hundreds
+// of queues and sleeps while all of them are idle.
+//
+// The awaitables use the reactor running on the calling thread, so they
+// may only be awaited from tasks that reactor runs. Queues are waited
+// on through this process' eventfds, which mfserver hands out; it must
+// be running. Broadcast queues have no eventfds.
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "mf.hpp"
+
+namespace mf {
+
+class Reactor;
+
+namespace detail {
+
+// a suspended co_await: attempt() tries the operation once and returns
+// true when the coroutine can be resumed, with a result or an error
+struct Waiter {
+    std::coroutine_handle<> handle;
+    std::exception_ptr error;
+
+    virtual bool attempt() = 0;
+
+    bool try_attempt() {
+        try {
+            return attempt();
+        } catch (...) {
+            error = std::current_exception();
+            return true;
+        }
+    }
+
+protected:
+    ~Waiter() = default;
+};
+
+inline Reactor *&current_reactor() {
+    static thread_local Reactor *reactor = nullptr;
+    return reactor;
+}
+
+}  // namespace detail
+
+// a coroutine the reactor runs; it starts when spawned and is destroyed
+// by the reactor when it returns
+class Task {
+public:
+    struct promise_type {
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+private:
+    friend class Reactor;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// an epoll loop over queue eventfds that runs Tasks
+class Reactor {
+public:
+    Reactor() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {
+        if (epfd_ < 0)
+            throw Error("epoll_create1");
+    }
+    ~Reactor() {
+        for (auto h : tasks_)
+            h.destroy();
+        close(epfd_);
+    }
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    // run task from the next run() on; with run() going, right away
+    void spawn(Task task) {
+        auto h = std::exchange(task.handle_, nullptr);
+        tasks_.push_back(h);
+        ready_.push_back(h);
+    }
+
+    // resume tasks until all of them returned or stop() was called; an
+    // exception a task let out ends the run and is thrown from here
+    void run() {
+        Reactor *outer = std::exchange(detail::current_reactor(), this);
+        struct Restore {
+            Reactor *outer;
+            ~Restore() { detail::current_reactor() = outer; }
+        } restore{outer};
+        struct epoll_event events[MF_EVENTS];
+
+        stopped_ = false;
+        while (!tasks_.empty() && !stopped_) {
+            resume_ready();
+            if (tasks_.empty() || stopped_)
+                break;
+            int n = epoll_wait(epfd_, events, MF_EVENTS, -1);
+            if (n < 0 && errno != EINTR)
+                throw Error("epoll_wait");
+            for (int i = 0; i < n; i++)
+                fd_ready(events[i].data.fd);
+        }
+    }
+
+    void stop() { stopped_ = true; }
+
+    // tasks not returned yet
+    std::size_t size() const { return tasks_.size(); }
+
+    // park waiter until fd is readable
+    void wait(int fd, detail::Waiter *waiter) {
+        Watch &w = watches_[fd];
+        w.waiters.push_back(waiter);
+        try {
+            arm(fd, w);
+        } catch (...) {
+            w.waiters.pop_back();
+            throw;
+        }
+    }
+
+private:
+    struct Watch {
+        std::deque<detail::Waiter *> waiters;
+        bool added = false;  // in the epoll set
+        bool armed = false;  // and enabled; one-shot, so off after each event
+    };
+
+    // fds stay in the epoll set one-shot: an fd is only enabled while
+    // somebody waits on it, so a raised fd nobody waits on does not spin
+    void arm(int fd, Watch &w) {
+        if (w.armed)
+            return;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd_, w.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) != 0)
+            throw Error("epoll_ctl");
+        w.added = w.armed = true;
+    }
+
+    // retry the waiters of fd in order until one still finds the queue
+    // empty/full; that failed try re-armed the eventfd
+    void fd_ready(int fd) {
+        Watch &w = watches_[fd];
+        w.armed = false;
+        while (!w.waiters.empty() && w.waiters.front()->try_attempt()) {
+            ready_.push_back(w.waiters.front()->handle);
+            w.waiters.pop_front();
+        }
+        if (!w.waiters.empty())
+            arm(fd, w);
+    }
+
+    void resume_ready() {
+        while (!ready_.empty() && !stopped_) {
+            auto h = ready_.front();
+            ready_.pop_front();
+            h.resume();
+            if (!h.done())
+                continue;
+            auto task = std::coroutine_handle<Task::promise_type>::from_address(h.address());
+            std::exception_ptr error = task.promise().error;
+            std::erase(tasks_, h);
+            h.destroy();
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+
+    static constexpr int MF_EVENTS = 64;  // events per epoll_wait
+
+    int epfd_;
+    bool stopped_ = false;
+    std::vector<std::coroutine_handle<>> tasks_;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::unordered_map<int, Watch> watches_;
+};
+
+namespace detail {
+
+// the common part of the awaitables: try in await_ready, park on fd in
+// await_suspend, hand over the result or the error in await_resume
+template <class Derived>
+struct Awaiter : Waiter {
+    bool await_ready() { return try_attempt(); }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        Reactor *reactor = current_reactor();
+        if (reactor == nullptr)
+            throw Error("mf: co_await outside Reactor::run", EPERM);
+        handle = h;
+        reactor->wait(static_cast<Derived *>(this)->wait_fd(), this);
+    }
+
+    void check() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+template <class T>
+struct RecvAwaiter final : Awaiter<RecvAwaiter<T>> {
+    Queue<T> &q;
+    std::optional<T> v;
+
+    explicit RecvAwaiter(Queue<T> &q) : q(q) {}
+    bool attempt() override { return (v = q.try_recv(0)).has_value(); }
+    int wait_fd() { return q.fd(); }
+    T await_resume() {
+        this->check();
+        return *v;
+    }
+};
+
+template <class T>
+struct SendAwaiter final : Awaiter<SendAwaiter<T>> {
+    Queue<T> &q;
+    T v;
+
+    SendAwaiter(Queue<T> &q, const T &v) : q(q), v(v) {}
+    bool attempt() override { return q.try_send(v, 0); }
+    int wait_fd() { return q.space_fd(); }
+    void await_resume() { this->check(); }
+};
+
+struct ByteRecvAwaiter final : Awaiter<ByteRecvAwaiter> {
+    ByteQueue &q;
+    std::span<std::byte> buf;
+    std::size_t len = 0;
+
+    ByteRecvAwaiter(ByteQueue &q, std::span<std::byte> buf) : q(q), buf(buf) {}
+    bool attempt() override {
+        auto got = q.try_recv(buf, 0);
+        len = got.value_or(0);
+        return got.has_value();
+    }
+    int wait_fd() { return q.fd(); }
+    std::size_t await_resume() {
+        check();
+        return len;
+    }
+};
+
+struct ByteSendAwaiter final : Awaiter<ByteSendAwaiter> {
+    ByteQueue &q;
+    std::span<const std::byte> msg;
+
+    ByteSendAwaiter(ByteQueue &q, std::span<const std::byte> msg) : q(q), msg(msg) {}
+    bool attempt() override { return q.try_send(msg, 0); }
+    int wait_fd() { return q.space_fd(); }
+    void await_resume() { check(); }
+};
+
+}  // namespace detail
+
+// co_await recv(q): the next record of q
+template <class T>
+detail::RecvAwaiter<T> recv(Queue<T> &q) {
+    return detail::RecvAwaiter<T>(q);
+}
+
+// co_await send(q, v): v is copied into the awaitable, so it may be a
+// temporary
+template <class T>
+detail::SendAwaiter<T> send(Queue<T> &q, const T &v) {
+    return detail::SendAwaiter<T>(q, v);
+}
+
+// co_await recv(q, buf): the length of the message received into buf
+inline detail::ByteRecvAwaiter recv(ByteQueue &q, std::span<std::byte> buf) {
+    return detail::ByteRecvAwaiter(q, buf);
+}
+
+// co_await send(q, msg): msg must stay valid until the send completes
+inline detail::ByteSendAwaiter send(ByteQueue &q, std::span<const std::byte> msg) {
+    return detail::ByteSendAwaiter(q, msg);
+}
+
+}  // namespace mf
+
+#endif
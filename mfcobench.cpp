@@ -0,0 +1,301 @@
+// mfcobench: one consumer per queue on -q queues, run two ways: as
+// coroutines on a single mf::Reactor thread ("co", see mfco.hpp) and as
+// one thread per queue blocking in mf::Queue<T>::recv ("threads"). -c
+// picks which ("co,threads" runs both). A producer process sends -n
+// records of 64 bytes to every queue, round robin, as fast as it can or
+// -r records per second in total; -t picks the queue mode and -m the
+// queue size in KB.
+//
+// Per run it prints the consumers' wall time, throughput, CPU time (user
+// + system, all threads) and context switches, and the mean send-to-
+// receive latency. Paced runs (-r) show what idle queues cost each way;
+// -f csv prints comma-separated rows with the -l label in front.
+// mfserver must be running; for more than 5 queues raise
+// MAX_QUEUES_IN_SHMEM in mf.config, and for hundreds SEGMENT_SIZE or
+// MAX_SEGMENTS as well.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "mfco.hpp"
+
+struct rec_t {
+    unsigned long stamp;  // send time
+    long seq;             // index of the record in its queue
+    char pad[48];
+};
+
+// what the consumer process reports back, in shared memory
+struct result_t {
+    double elapsed;
+    double cpu;
+    long csw;
+    unsigned long lat_sum;
+    long errors;
+};
+
+// per queue, so consumer threads do not share counters
+struct tally_t {
+    unsigned long lat_sum;
+    long errors;
+} __attribute__((aligned(64)));
+
+static int nqueues = 4;
+static int nmsgs = 100000;
+static int mqsize = 16;  // KB
+static int mode = MF_MODE_LOCKED;
+static long rate = 0;    // records per second, 0 for no limit
+static int csv = 0;
+static const char *label = "";
+static FILE *out;  // results; stdout itself takes the library's chatter
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static std::string queue_name(int i)
+{
+    return "cobench" + std::to_string(i);
+}
+
+static void account(const rec_t &r, long i, tally_t *t)
+{
+    t->lat_sum += now_ns() - r.stamp;
+    if (r.seq != i)
+        t->errors++;
+}
+
+static mf::Task consume_co(mf::Queue<rec_t> &q, tally_t *t)
+{
+    for (long i = 0; i < nmsgs; i++)
+        account(co_await mf::recv(q), i, t);
+}
+
+static void consume_thread(mf::Queue<rec_t> &q, tally_t *t)
+{
+    for (long i = 0; i < nmsgs; i++)
+        account(q.recv(), i, t);
+}
+
+static void consumer(bool co, int ready_fd, result_t *res)
+{
+    mf::Connection conn;
+    std::vector<mf::Queue<rec_t>> qs;
+    std::vector<tally_t> tallies(nqueues);
+    struct rusage ru0, ru1;
+
+    for (int i = 0; i < nqueues; i++)
+        qs.emplace_back(queue_name(i));
+    getrusage(RUSAGE_SELF, &ru0);
+    unsigned long t0 = now_ns();
+    if (write(ready_fd, "r", 1) != 1)
+        exit(1);
+
+    if (co) {
+        mf::Reactor reactor;
+        for (int i = 0; i < nqueues; i++)
+            reactor.spawn(consume_co(qs[i], &tallies[i]));
+        reactor.run();
+    } else {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < nqueues; i++)
+            threads.emplace_back(consume_thread, std::ref(qs[i]), &tallies[i]);
+        for (auto &t : threads)
+            t.join();
+    }
+
+    res->elapsed = (now_ns() - t0) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+    res->cpu = ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec +
+               (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec + ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+    res->csw = ru1.ru_nvcsw - ru0.ru_nvcsw + ru1.ru_nivcsw - ru0.ru_nivcsw;
+    for (auto &t : tallies) {
+        res->lat_sum += t.lat_sum;
+        res->errors += t.errors;
+    }
+}
+
+static void producer()
+{
+    mf::Connection conn;
+    std::vector<mf::Queue<rec_t>> qs;
+    rec_t r = {};
+
+    for (int i = 0; i < nqueues; i++)
+        qs.emplace_back(queue_name(i));
+    unsigned long t0 = now_ns();
+    for (long i = 0; i < nmsgs; i++) {
+        if (rate > 0) {
+            // a round of one record per queue every nqueues / rate seconds
+            unsigned long due = t0 + i * nqueues * 1000000000UL / rate;
+            struct timespec ts = { (time_t)(due / 1000000000UL), (long)(due % 1000000000UL) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        r.seq = i;
+        for (auto &q : qs) {
+            r.stamp = now_ns();
+            q.send(r);
+        }
+    }
+}
+
+// fork f into a child process, which exits 1 on an mf::Error
+template <class F>
+static pid_t spawn_child(F f)
+{
+    fflush(out);
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    try {
+        f();
+    } catch (const mf::Error &e) {
+        fprintf(stderr, "mfcobench: %s\n", e.what());
+        _exit(1);
+    }
+    _exit(0);
+}
+
+static void print_header()
+{
+    if (csv)
+        fprintf(out, "label,consumers,mode,queues,msgs,rate,elapsed_s,msgs_per_s,cpu_s,csw,lat_mean_us,errors\n");
+    else
+        fprintf(out, "%-9s %6s %8s %8s %8s %12s %8s %10s %10s\n",
+                "consumers", "queues", "rate", "msgs", "elapsed", "msgs/s", "cpu_s", "csw", "lat_us");
+}
+
+static int run(bool co, const char *mode_name)
+{
+    auto *res = (result_t *)mmap(NULL, sizeof(result_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int ready[2], status, ok = 1;
+    char c;
+
+    if (res == MAP_FAILED)
+        throw mf::Error("mmap");
+    memset(res, 0, sizeof(*res));
+    for (int i = 0; i < nqueues; i++) {
+        try {
+            if (mode == MF_MODE_FIXED)
+                mf::create_fixed<rec_t>(queue_name(i).c_str(), mqsize * 1024 / sizeof(rec_t));
+            else
+                mf::create(queue_name(i).c_str(), mqsize, mode);
+        } catch (const mf::Error &) {
+            while (i-- > 0)  // e.g. MAX_QUEUES_IN_SHMEM reached: leave none behind
+                mf::remove(queue_name(i).c_str());
+            throw;
+        }
+    }
+    if (pipe(ready) != 0)
+        throw mf::Error("pipe");
+
+    pid_t cons = spawn_child([&] { consumer(co, ready[1], res); });
+    if (read(ready[0], &c, 1) != 1)
+        ok = 0;  // the consumer failed to start
+    pid_t prod = ok ? spawn_child(producer) : -1;
+    for (pid_t pid : {cons, prod})
+        if (pid > 0 && (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            ok = 0;
+    close(ready[0]);
+    close(ready[1]);
+    for (int i = 0; i < nqueues; i++)
+        mf::remove(queue_name(i).c_str());
+
+    if (ok) {
+        double total = (double)nmsgs * nqueues;
+        const char *cons_name = co ? "co" : "threads";
+        double lat_us = res->lat_sum / total / 1e3;
+        if (csv)
+            fprintf(out, "%s,%s,%s,%d,%d,%ld,%.6f,%.0f,%.4f,%ld,%.1f,%ld\n", label, cons_name, mode_name,
+                    nqueues, nmsgs, rate, res->elapsed, total / res->elapsed, res->cpu, res->csw, lat_us, res->errors);
+        else
+            fprintf(out, "%-9s %6d %8ld %8d %8.3f %12.0f %8.3f %10ld %10.1f\n", cons_name, nqueues, rate, nmsgs,
+                    res->elapsed, total / res->elapsed, res->cpu, res->csw, lat_us);
+        if (res->errors != 0)
+            fprintf(stderr, "mfcobench: %ld records out of order\n", res->errors);
+    }
+    munmap(res, sizeof(result_t));
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode_name = "locked";
+    bool run_co = true, run_threads = true;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:q:m:r:t:c:f:l:")) != -1) {
+        switch (opt) {
+        case 'n': nmsgs = atoi(optarg); break;
+        case 'q': nqueues = atoi(optarg); break;
+        case 'm': mqsize = atoi(optarg); break;
+        case 'r': rate = atol(optarg); break;
+        case 'l': label = optarg; break;
+        case 'c':
+            run_co = strstr(optarg, "co") != NULL;
+            run_threads = strstr(optarg, "threads") != NULL;
+            if (!run_co && !run_threads) {
+                fprintf(stderr, "mfcobench: unknown consumers %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                csv = 1;
+            else if (strcmp(optarg, "table") != 0) {
+                fprintf(stderr, "mfcobench: unknown format %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            mode_name = optarg;
+            if (strcmp(optarg, "spsc") == 0)
+                mode = MF_MODE_SPSC;
+            else if (strcmp(optarg, "mpmc") == 0)
+                mode = MF_MODE_MPMC;
+            else if (strcmp(optarg, "locked") == 0)
+                mode = MF_MODE_LOCKED;
+            else if (strcmp(optarg, "fixed") == 0)
+                mode = MF_MODE_FIXED;
+            else {
+                fprintf(stderr, "mfcobench: unknown queue mode %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("usage: mfcobench [-n msgs] [-q queues] [-m mqsizeKB] [-r rate] [-c co,threads] "
+                   "[-t locked|spsc|mpmc|fixed] [-f table|csv] [-l label]\n");
+            exit(1);
+        }
+    }
+    if (nmsgs <= 0 || nqueues <= 0 || rate < 0) {
+        fprintf(stderr, "mfcobench: invalid arguments\n");
+        exit(1);
+    }
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+    try {
+        mf::Connection conn;
+        print_header();
+        if (run_co)
+            failed |= run(true, mode_name);
+        if (run_threads)
+            failed |= run(false, mode_name);
+    } catch (const mf::Error &e) {
+        fprintf(stderr, "mfcobench: %s\n", e.what());
+        return 1;
+    }
+    fflush(out);
+    return failed;
+}
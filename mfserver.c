@@ -13,12 +13,20 @@
 //
 
 
+static volatile sig_atomic_t dump_latency, reset_latency;
+
 static void signal_handler(int signo) {
     if (signo == SIGINT || signo == SIGTERM) {
         printf("Received signal %d, cleaning up...\n", signo);
         mf_destroy();
         exit(0);
     }
+    // SIGUSR1 dumps the latency histograms of traced queues, SIGUSR2
+    // dumps and then resets them; the main loop does the work
+    if (signo == SIGUSR1 || signo == SIGUSR2)
+        dump_latency = 1;
+    if (signo == SIGUSR2)
+        reset_latency = 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -27,6 +35,8 @@ int main(int argc, char *argv[]) {
     // Register signal handler
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    signal(SIGUSR2, signal_handler);
 
     // Initialize the MF library
     if (mf_init() != 0) {
@@ -34,9 +44,22 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Server main loop
+    // Server main loop: hand out readiness fds (mf_get_fd); a signal
+    // makes mf_serve return early
     while (1) {
-        sleep(1000);
+        mf_serve(1000);
+        if (dump_latency) {
+            dump_latency = 0;
+            mf_print_latency();
+            fflush(stdout);
+        }
+        if (reset_latency) {
+            int qids[MF_MAX_QUEUES];
+            int n = min(mf_list(qids, MF_MAX_QUEUES), MF_MAX_QUEUES);
+            reset_latency = 0;
+            for (int i = 0; i < n; i++)
+                mf_reset_latency(qids[i]);  // ENODATA for untraced queues
+        }
     }
 
     return 0;
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "mf.h"
+
+// mfstat: live view of the MF queues, in the spirit of vmstat.
+//
+//   mfstat [-q name] [interval [count]]
+//   mfstat -l
+//
+// attaches to the region read-only and every interval seconds (default
+// 1) prints one line per queue with the rates over that interval: sent
+// and received messages and KB per second, sends that found the queue
+// full and receives that found it empty, and milliseconds per second
+// spent waiting for a contended queue lock, next to the current depth
+// and the high-water mark. Stops after count reports if given. -q shows
+// only the named queue. The counters are kept by the library, so the
+// processes being watched need no changes.
+//
+// -l prints the send-to-receive latency of the traced queues (TRACE_LATENCY
+// or QUEUE ... TRACE=1 in mf.config) and exits; kill -USR2 mfserver
+// resets the histograms.
+
+typedef struct {
+    int qid;
+    mf_qstats_t st;
+} sample_t;
+
+static sample_t prev[MF_MAX_QUEUES];
+static int nprev;
+
+static const char *mode_name(int mode) {
+    return mode == MF_MODE_SPSC ? "spsc" : mode == MF_MODE_MPMC ? "mpmc" : mode == MF_MODE_BCAST ? "bcast" :
+           mode == MF_MODE_FIXED ? "fixed" : "locked";
+}
+
+// counters of qid at the last report, or NULL for a queue not seen yet
+static mf_qstats_t *prev_stats(int qid) {
+    for (int i = 0; i < nprev; i++)
+        if (prev[i].qid == qid)
+            return &prev[i].st;
+    return NULL;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-q name] [interval [count]] | -l\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *only = NULL;
+    int interval = 1, count = -1, latency = 0, opt;
+
+    while ((opt = getopt(argc, argv, "q:lh")) != -1) {
+        if (opt == 'q')
+            only = optarg;
+        else if (opt == 'l')
+            latency = 1;
+        else
+            usage(argv[0]);
+    }
+    if (optind < argc)
+        interval = atoi(argv[optind++]);
+    if (optind < argc)
+        count = atoi(argv[optind++]);
+    if (interval <= 0 || optind < argc)
+        usage(argv[0]);
+
+    if (mf_connect_readonly() != 0) {
+        fprintf(stderr, "mfstat: cannot attach, is mfserver running?\n");
+        exit(1);
+    }
+    if (latency) {
+        mf_print_latency();
+        mf_disconnect();
+        return 0;
+    }
+
+    // the first sample is only the baseline for the rates
+    int qids[MF_MAX_QUEUES];
+    int n = min(mf_list(qids, MF_MAX_QUEUES), MF_MAX_QUEUES);
+    for (int i = 0; i < n; i++)
+        if (mf_get_stats(qids[i], &prev[nprev].st) == 0)
+            prev[nprev++].qid = qids[i];
+
+    while (count != 0) {
+        sleep(interval);
+
+        sample_t cur[MF_MAX_QUEUES];
+        int ncur = 0;
+        n = min(mf_list(qids, MF_MAX_QUEUES), MF_MAX_QUEUES);
+        for (int i = 0; i < n; i++)
+            if (mf_get_stats(qids[i], &cur[ncur].st) == 0)
+                cur[ncur++].qid = qids[i];
+
+        printf("%-16s %-6s %8s %8s %10s %10s %10s %10s %8s %8s %9s\n",
+               "queue", "mode", "depth", "peak KB", "enq/s", "deq/s", "in KB/s",
+               "out KB/s", "full/s", "empty/s", "lock ms/s");
+        for (int i = 0; i < ncur; i++) {
+            mf_qstats_t *c = &cur[i].st, zero, *p = prev_stats(cur[i].qid);
+            if (only != NULL && strcmp(c->name, only) != 0)
+                continue;
+            if (p == NULL) {
+                memset(&zero, 0, sizeof(zero));  // created during the interval
+                p = &zero;
+            }
+            printf("%-16s %-6s %8lu %8lu %10.0f %10.0f %10.1f %10.1f %8.0f %8.0f %9.2f\n",
+                   c->name, mode_name(c->mode), c->depth, c->peak_bytes / 1024,
+                   (double)(c->enq_msgs - p->enq_msgs) / interval,
+                   (double)(c->deq_msgs - p->deq_msgs) / interval,
+                   (c->enq_bytes - p->enq_bytes) / 1024.0 / interval,
+                   (c->deq_bytes - p->deq_bytes) / 1024.0 / interval,
+                   (double)(c->full - p->full) / interval,
+                   (double)(c->empty - p->empty) / interval,
+                   (c->lock_wait_ns - p->lock_wait_ns) / 1e6 / interval);
+        }
+        printf("\n");
+        fflush(stdout);
+
+        memcpy(prev, cur, ncur * sizeof(cur[0]));
+        nprev = ncur;
+        if (count > 0)
+            count--;
+    }
+
+    mf_disconnect();
+    return 0;
+}